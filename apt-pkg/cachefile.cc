@@ -43,6 +43,8 @@ struct pkgCacheFile::Private
 {
    bool WithLock = false;
    bool InhibitActionGroups = false;
+   // the policy was built by BuildPolicy from the preferences alone
+   bool PolicyFromPreferences = false;
 };
 
 // CacheFile::CacheFile - Constructor					/*{{{*/
@@ -179,6 +181,7 @@ bool pkgCacheFile::BuildPolicy(OpProgress * /*Progress*/)
    ReadPinDir(*Policy);
 
    this->Policy = Policy.release();
+   d->PolicyFromPreferences = true;
    return _error->PendingError() == false;
 }
 									/*}}}*/
@@ -202,6 +205,8 @@ bool pkgCacheFile::BuildDepCache(OpProgress *Progress)
       return false;
    if (d->InhibitActionGroups)
       DCache->IncreaseActionGroupLevel();
+   if (d->PolicyFromPreferences)
+      DCache->SetPolicyFromPreferences();
    if (DCache->Init(Progress) == false)
       return false;
 
@@ -253,6 +258,7 @@ bool pkgCacheFile::AddIndexFile(pkgIndexFile * const File)		/*{{{*/
    delete Policy;
    DCache = NULL;
    Policy = NULL;
+   d->PolicyFromPreferences = false;
    Cache = NULL;
 
    if (ExternOwner == false)
@@ -375,6 +381,7 @@ void pkgCacheFile::Close()
    Map = NULL;
    DCache = NULL;
    Policy = NULL;
+   d->PolicyFromPreferences = false;
    Cache = NULL;
    SrcList = NULL;
 }
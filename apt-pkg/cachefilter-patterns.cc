@@ -10,6 +10,8 @@
 
 #include <apt-pkg/cachefilter-patterns.h>
 
+#include <algorithm>
+
 #include <apti18n.h>
 
 using namespace std::literals;
@@ -422,6 +424,15 @@ bool PatternTreeParser::PatternNode::matches(std::string_view name, int min, int
 }
 
 std::unique_ptr<APT::CacheFilter::Matcher> PatternParser::aPattern(std::unique_ptr<PatternTreeParser::Node> &nodeP)
+{
+   auto pattern = aPatternNode(nodeP);
+   std::ostringstream rendered;
+   nodeP->render(rendered);
+   keys[pattern.get()] = rendered.str();
+   return pattern;
+}
+
+std::unique_ptr<APT::CacheFilter::Matcher> PatternParser::aPatternNode(std::unique_ptr<PatternTreeParser::Node> &nodeP)
 {
    assert(nodeP != nullptr);
    auto node = dynamic_cast<PatternTreeParser::PatternNode *>(nodeP.get());
@@ -495,7 +506,7 @@ std::unique_ptr<APT::CacheFilter::Matcher> PatternParser::aPattern(std::unique_p
    if (node->matches("?name", 1, 1))
       return std::make_unique<APT::CacheFilter::PackageNameMatchesRegEx>(aWord(node->arguments[0]));
    if (node->matches("?not", 1, 1))
-      return std::make_unique<APT::CacheFilter::NOTMatcher>(aPattern(node->arguments[0]).release());
+      return std::make_unique<Patterns::MatchNot>(aPattern(node->arguments[0]));
    if (node->matches("?obsolete", 0, 0))
       return std::make_unique<Patterns::PackageIsObsolete>();
    if (node->matches("?origin", 1, 1))
@@ -524,19 +535,19 @@ std::unique_ptr<APT::CacheFilter::Matcher> PatternParser::aPattern(std::unique_p
    // Variable argument patterns
    if (node->matches("?and", 0, -1) || node->matches("?narrow", 0, -1))
    {
-      auto pattern = std::make_unique<APT::CacheFilter::ANDMatcher>();
+      auto pattern = std::make_unique<Patterns::MatchAll>();
       for (auto &arg : node->arguments)
-	 pattern->AND(aPattern(arg).release());
+	 pattern->matchers.push_back(aPattern(arg));
       if (node->term == "?narrow")
 	 return std::make_unique<Patterns::VersionIsAnyVersion>(std::move(pattern));
       return pattern;
    }
    if (node->matches("?or", 0, -1))
    {
-      auto pattern = std::make_unique<APT::CacheFilter::ORMatcher>();
+      auto pattern = std::make_unique<Patterns::MatchAny>();
 
       for (auto &arg : node->arguments)
-	 pattern->OR(aPattern(arg).release());
+	 pattern->matchers.push_back(aPattern(arg));
       return pattern;
    }
 
@@ -583,6 +594,269 @@ BaseRegexMatcher::~BaseRegexMatcher()
       return;
    regfree(&*pattern);
 }
+
+bool CompiledPattern::markStateful(Matcher const &M)
+{
+   bool Stateful = false;
+   if (auto const All = dynamic_cast<MatchAll const *>(&M))
+   {
+      for (auto const &Arg : All->matchers)
+	 Stateful |= markStateful(*Arg);
+   }
+   else if (auto const Any = dynamic_cast<MatchAny const *>(&M))
+   {
+      for (auto const &Arg : Any->matchers)
+	 Stateful |= markStateful(*Arg);
+   }
+   else if (auto const Not = dynamic_cast<MatchNot const *>(&M))
+      Stateful = markStateful(*Not->matcher);
+   else if (auto const AnyVer = dynamic_cast<VersionIsAnyVersion const *>(&M))
+      Stateful = markStateful(*AnyVer->base);
+   else if (auto const AllVer = dynamic_cast<VersionIsAllVersions const *>(&M))
+      Stateful = markStateful(*AllVer->base);
+   else if (auto const Depends = dynamic_cast<VersionDepends const *>(&M))
+      Stateful = markStateful(*Depends->base);
+   else if (auto const RDepends = dynamic_cast<PackageReverseDepends const *>(&M))
+      Stateful = markStateful(*RDepends->base);
+   else
+      // the candidate, the marks and the auto bits can change at any time
+      Stateful = dynamic_cast<PackageIsAutomatic const *>(&M) != nullptr ||
+		 dynamic_cast<PackageIsBroken const *>(&M) != nullptr ||
+		 dynamic_cast<PackageIsGarbage const *>(&M) != nullptr ||
+		 dynamic_cast<PackageIsPhasing const *>(&M) != nullptr ||
+		 dynamic_cast<PackageIsUpgradable const *>(&M) != nullptr;
+   if (Stateful)
+      stateful.insert(&M);
+   return Stateful;
+}
+
+bool CompiledPattern::matches(Matcher &M, pkgCache::PkgIterator const &Pkg)
+{
+   if (stateful.find(&M) == stateful.end())
+      return packages(M).test(Pkg->ID);
+   if (auto const All = dynamic_cast<MatchAll *>(&M))
+      return std::all_of(All->matchers.begin(), All->matchers.end(), [&](auto &Arg) { return matches(*Arg, Pkg); });
+   if (auto const Any = dynamic_cast<MatchAny *>(&M))
+      return std::any_of(Any->matchers.begin(), Any->matchers.end(), [&](auto &Arg) { return matches(*Arg, Pkg); });
+   if (auto const Not = dynamic_cast<MatchNot *>(&M))
+      return not matches(*Not->matcher, Pkg);
+   return M(Pkg);
+}
+
+bool CompiledPattern::matches(Matcher &M, pkgCache::VerIterator const &Ver)
+{
+   if (stateful.find(&M) == stateful.end())
+      return versions(M).test(Ver->ID);
+   if (auto const All = dynamic_cast<MatchAll *>(&M))
+      return std::all_of(All->matchers.begin(), All->matchers.end(), [&](auto &Arg) { return matches(*Arg, Ver); });
+   if (auto const Any = dynamic_cast<MatchAny *>(&M))
+      return std::any_of(Any->matchers.begin(), Any->matchers.end(), [&](auto &Arg) { return matches(*Arg, Ver); });
+   if (auto const Not = dynamic_cast<MatchNot *>(&M))
+      return not matches(*Not->matcher, Ver);
+   return M(Ver);
+}
+
+std::string CompiledPattern::key(Matcher const &M) const
+{
+   auto const K = keys.find(&M);
+   if (K != keys.end())
+      return K->second;
+   // matchers created without a node of their own are not shared
+   std::ostringstream os;
+   os << "@" << static_cast<void const *>(&M);
+   return os.str();
+}
+
+MatchSet const &CompiledPattern::packages(Matcher &M)
+{
+   auto const K = key(M);
+   auto const Memo = packageMemo.find(K);
+   if (Memo != packageMemo.end())
+      return Memo->second;
+   auto Result = computePackages(M);
+   return packageMemo.emplace(K, std::move(Result)).first->second;
+}
+
+MatchSet const &CompiledPattern::versions(Matcher &M)
+{
+   auto const K = key(M);
+   auto const Memo = versionMemo.find(K);
+   if (Memo != versionMemo.end())
+      return Memo->second;
+   auto Result = computeVersions(M);
+   return versionMemo.emplace(K, std::move(Result)).first->second;
+}
+
+MatchSet CompiledPattern::anyVersion(MatchSet const &Versions)
+{
+   MatchSet Result(cache->Head().PackageCount, false);
+   for (auto Pkg = cache->PkgBegin(); not Pkg.end(); ++Pkg)
+      for (auto Ver = Pkg.VersionList(); not Ver.end(); ++Ver)
+	 if (Versions.test(Ver->ID))
+	 {
+	    Result.set(Pkg->ID);
+	    break;
+	 }
+   return Result;
+}
+
+MatchSet CompiledPattern::computePackages(Matcher &M)
+{
+   if (auto const All = dynamic_cast<MatchAll *>(&M))
+   {
+      MatchSet Result(cache->Head().PackageCount, true);
+      for (auto &Arg : All->matchers)
+	 Result &= packages(*Arg);
+      return Result;
+   }
+   if (auto const Any = dynamic_cast<MatchAny *>(&M))
+   {
+      MatchSet Result(cache->Head().PackageCount, false);
+      for (auto &Arg : Any->matchers)
+	 Result |= packages(*Arg);
+      return Result;
+   }
+   if (auto const Not = dynamic_cast<MatchNot *>(&M))
+   {
+      MatchSet Result = packages(*Not->matcher);
+      return Result.flip();
+   }
+   if (auto const AnyVer = dynamic_cast<VersionIsAnyVersion *>(&M))
+      return anyVersion(versions(*AnyVer->base));
+   if (auto const AllVer = dynamic_cast<VersionIsAllVersions *>(&M))
+   {
+      auto const &Versions = versions(*AllVer->base);
+      MatchSet Result(cache->Head().PackageCount, true);
+      for (auto Pkg = cache->PkgBegin(); not Pkg.end(); ++Pkg)
+	 for (auto Ver = Pkg.VersionList(); not Ver.end(); ++Ver)
+	    if (not Versions.test(Ver->ID))
+	    {
+	       Result.reset(Pkg->ID);
+	       break;
+	    }
+      return Result;
+   }
+   if (auto const RDepends = dynamic_cast<PackageReverseDepends *>(&M))
+   {
+      auto const &Versions = versions(*RDepends->base);
+      MatchSet Result(cache->Head().PackageCount, false);
+      for (auto Pkg = cache->PkgBegin(); not Pkg.end(); ++Pkg)
+	 for (auto D = Pkg.RevDependsList(); not D.end(); ++D)
+	    if (not D.IsImplicit() && D->Type == RDepends->type && Versions.test(D.ParentVer()->ID))
+	    {
+	       Result.set(Pkg->ID);
+	       break;
+	    }
+      return Result;
+   }
+   // ?depends and all other version patterns match a package if they match one of its versions
+   if (dynamic_cast<VersionAnyMatcher *>(&M) != nullptr)
+      return anyVersion(versions(M));
+
+   MatchSet Result(cache->Head().PackageCount, false);
+   for (auto Pkg = cache->PkgBegin(); not Pkg.end(); ++Pkg)
+      if (M(Pkg))
+	 Result.set(Pkg->ID);
+   return Result;
+}
+
+MatchSet CompiledPattern::computeVersions(Matcher &M)
+{
+   if (auto const All = dynamic_cast<MatchAll *>(&M))
+   {
+      MatchSet Result(cache->Head().VersionCount, true);
+      for (auto &Arg : All->matchers)
+	 Result &= versions(*Arg);
+      return Result;
+   }
+   if (auto const Any = dynamic_cast<MatchAny *>(&M))
+   {
+      MatchSet Result(cache->Head().VersionCount, false);
+      for (auto &Arg : Any->matchers)
+	 Result |= versions(*Arg);
+      return Result;
+   }
+   if (auto const Not = dynamic_cast<MatchNot *>(&M))
+   {
+      MatchSet Result = versions(*Not->matcher);
+      return Result.flip();
+   }
+   if (auto const AnyVer = dynamic_cast<VersionIsAnyVersion *>(&M))
+      return versions(*AnyVer->base);
+   if (auto const AllVer = dynamic_cast<VersionIsAllVersions *>(&M))
+      return versions(*AllVer->base);
+
+   MatchSet Result(cache->Head().VersionCount, false);
+   if (auto const Depends = dynamic_cast<VersionDepends *>(&M))
+   {
+      auto const &Packages = packages(*Depends->base);
+      for (auto Pkg = cache->PkgBegin(); not Pkg.end(); ++Pkg)
+	 for (auto Ver = Pkg.VersionList(); not Ver.end(); ++Ver)
+	    for (auto D = Ver.DependsList(); not D.end(); ++D)
+	       if (not D.IsImplicit() && D->Type == Depends->type && Packages.test(D.TargetPkg()->ID))
+	       {
+		  Result.set(Ver->ID);
+		  break;
+	       }
+      return Result;
+   }
+   if (auto const Files = dynamic_cast<VersionFileMatcher *>(&M))
+   {
+      // the few package files are checked only once each
+      MatchSet FileMatches(cache->Head().PackageFileCount, false);
+      for (auto File = cache->FileBegin(); not File.end(); ++File)
+	 if (Files->fileMatches(File))
+	    FileMatches.set(File->ID);
+      for (auto Pkg = cache->PkgBegin(); not Pkg.end(); ++Pkg)
+	 for (auto Ver = Pkg.VersionList(); not Ver.end(); ++Ver)
+	    for (auto VF = Ver.FileList(); not VF.end(); ++VF)
+	       if (FileMatches.test(VF.File()->ID))
+	       {
+		  Result.set(Ver->ID);
+		  break;
+	       }
+      return Result;
+   }
+   // package patterns match a version if they match its package,
+   // except for ?installed which only matches the installed version
+   if (dynamic_cast<PackageMatcher *>(&M) != nullptr && dynamic_cast<PackageIsInstalled *>(&M) == nullptr)
+   {
+      auto const &Packages = packages(M);
+      for (auto Pkg = cache->PkgBegin(); not Pkg.end(); ++Pkg)
+	 if (Packages.test(Pkg->ID))
+	    for (auto Ver = Pkg.VersionList(); not Ver.end(); ++Ver)
+	       Result.set(Ver->ID);
+      return Result;
+   }
+
+   for (auto Pkg = cache->PkgBegin(); not Pkg.end(); ++Pkg)
+      for (auto Ver = Pkg.VersionList(); not Ver.end(); ++Ver)
+	 if (M(Ver))
+	    Result.set(Ver->ID);
+   return Result;
+}
+
+bool CompiledPattern::operator()(pkgCache::PkgIterator const &Pkg)
+{
+   if (Pkg.Cache() != cache)
+      return (*pattern)(Pkg);
+   if (stateful.empty() == false)
+      return matches(*pattern, Pkg);
+   if (packageResult == nullptr)
+      packageResult = &packages(*pattern);
+   return packageResult->test(Pkg->ID);
+}
+
+bool CompiledPattern::operator()(pkgCache::VerIterator const &Ver)
+{
+   if (Ver.Cache() != cache)
+      return (*pattern)(Ver);
+   if (stateful.empty() == false)
+      return matches(*pattern, Ver);
+   if (versionResult == nullptr)
+      versionResult = &versions(*pattern);
+   return versionResult->test(Ver->ID);
+}
 } // namespace Patterns
 
 } // namespace Internal
@@ -597,7 +871,10 @@ std::unique_ptr<APT::CacheFilter::Matcher> APT::CacheFilter::ParsePattern(std::s
    {
       auto top = APT::Internal::PatternTreeParser(pattern).parseTop();
       APT::Internal::PatternParser parser{file};
-      return parser.aPattern(top);
+      auto matcher = parser.aPattern(top);
+      if (file == nullptr || matcher == nullptr || _config->FindB("APT::Patterns::Compile", true) == false)
+	 return matcher;
+      return std::make_unique<APT::Internal::Patterns::CompiledPattern>(file->GetPkgCache(), std::move(matcher), std::move(parser.keys));
    }
    catch (APT::Internal::PatternTreeParser::Error &e)
    {
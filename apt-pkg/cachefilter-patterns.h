@@ -14,12 +14,16 @@
 #include <apt-pkg/header-is-private.h>
 #include <apt-pkg/strutl.h>
 #include <cassert>
+#include <cstdint>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <optional>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace APT
@@ -137,9 +141,14 @@ struct APT_PUBLIC PatternTreeParser
 struct APT_HIDDEN PatternParser
 {
    pkgCacheFile *file;
+   /// \brief The rendered pattern each created matcher stands for
+   std::map<APT::CacheFilter::Matcher const *, std::string> keys{};
 
    std::unique_ptr<APT::CacheFilter::Matcher> aPattern(std::unique_ptr<PatternTreeParser::Node> &nodeP);
    std::string aWord(std::unique_ptr<PatternTreeParser::Node> &nodeP);
+
+   private:
+   std::unique_ptr<APT::CacheFilter::Matcher> aPatternNode(std::unique_ptr<PatternTreeParser::Node> &nodeP);
 };
 
 namespace Patterns
@@ -161,6 +170,54 @@ class BaseRegexMatcher
    }
 };
 
+/** \brief Matches if all of the given matchers match */
+struct APT_HIDDEN MatchAll : public Matcher
+{
+   std::vector<std::unique_ptr<Matcher>> matchers;
+   bool operator()(pkgCache::PkgIterator const &Pkg) override { return all(Pkg); }
+   bool operator()(pkgCache::GrpIterator const &Grp) override { return all(Grp); }
+   bool operator()(pkgCache::VerIterator const &Ver) override { return all(Ver); }
+
+   private:
+   template <typename Iterator>
+   bool all(Iterator const &It)
+   {
+      for (auto &M : matchers)
+	 if (not(*M)(It))
+	    return false;
+      return true;
+   }
+};
+
+/** \brief Matches if any of the given matchers matches */
+struct APT_HIDDEN MatchAny : public Matcher
+{
+   std::vector<std::unique_ptr<Matcher>> matchers;
+   bool operator()(pkgCache::PkgIterator const &Pkg) override { return any(Pkg); }
+   bool operator()(pkgCache::GrpIterator const &Grp) override { return any(Grp); }
+   bool operator()(pkgCache::VerIterator const &Ver) override { return any(Ver); }
+
+   private:
+   template <typename Iterator>
+   bool any(Iterator const &It)
+   {
+      for (auto &M : matchers)
+	 if ((*M)(It))
+	    return true;
+      return false;
+   }
+};
+
+/** \brief Matches if the given matcher does not match */
+struct APT_HIDDEN MatchNot : public Matcher
+{
+   std::unique_ptr<Matcher> matcher;
+   explicit MatchNot(std::unique_ptr<Matcher> matcher) : matcher(std::move(matcher)) {}
+   bool operator()(pkgCache::PkgIterator const &Pkg) override { return not(*matcher)(Pkg); }
+   bool operator()(pkgCache::GrpIterator const &Grp) override { return not(*matcher)(Grp); }
+   bool operator()(pkgCache::VerIterator const &Ver) override { return not(*matcher)(Ver); }
+};
+
 struct APT_HIDDEN PackageIsAutomatic : public PackageMatcher
 {
    pkgCacheFile *Cache;
@@ -374,48 +431,48 @@ struct APT_HIDDEN VersionIsAnyVersion : public VersionAnyMatcher
    }
 };
 
-struct APT_HIDDEN VersionIsArchive : public VersionAnyMatcher
+/** \brief Matches versions by the package files they are in */
+struct APT_HIDDEN VersionFileMatcher : public VersionAnyMatcher
 {
-   BaseRegexMatcher matcher;
-   VersionIsArchive(std::string const &pattern) : matcher(pattern) {}
+   virtual bool fileMatches(pkgCache::PkgFileIterator const &File) = 0;
    bool operator()(pkgCache::VerIterator const &Ver) override
    {
       for (auto VF = Ver.FileList(); not VF.end(); VF++)
       {
-	 if (VF.File().Archive() && matcher(VF.File().Archive()))
+	 if (fileMatches(VF.File()))
 	    return true;
       }
       return false;
    }
 };
 
-struct APT_HIDDEN VersionIsCodename : public VersionAnyMatcher
+struct APT_HIDDEN VersionIsArchive : public VersionFileMatcher
+{
+   BaseRegexMatcher matcher;
+   VersionIsArchive(std::string const &pattern) : matcher(pattern) {}
+   bool fileMatches(pkgCache::PkgFileIterator const &File) override
+   {
+      return File.Archive() && matcher(File.Archive());
+   }
+};
+
+struct APT_HIDDEN VersionIsCodename : public VersionFileMatcher
 {
    BaseRegexMatcher matcher;
    VersionIsCodename(std::string const &pattern) : matcher(pattern) {}
-   bool operator()(pkgCache::VerIterator const &Ver) override
+   bool fileMatches(pkgCache::PkgFileIterator const &File) override
    {
-      for (auto VF = Ver.FileList(); not VF.end(); VF++)
-      {
-	 if (VF.File().Codename() && matcher(VF.File().Codename()))
-	    return true;
-      }
-      return false;
+      return File.Codename() && matcher(File.Codename());
    }
 };
 
-struct APT_HIDDEN VersionIsOrigin : public VersionAnyMatcher
+struct APT_HIDDEN VersionIsOrigin : public VersionFileMatcher
 {
    BaseRegexMatcher matcher;
    VersionIsOrigin(std::string const &pattern) : matcher(pattern) {}
-   bool operator()(pkgCache::VerIterator const &Ver) override
+   bool fileMatches(pkgCache::PkgFileIterator const &File) override
    {
-      for (auto VF = Ver.FileList(); not VF.end(); VF++)
-      {
-	 if (VF.File().Origin() && matcher(VF.File().Origin()))
-	    return true;
-      }
-      return false;
+      return File.Origin() && matcher(File.Origin());
    }
 };
 
@@ -478,6 +535,90 @@ struct APT_HIDDEN VersionIsPriority : public VersionAnyMatcher
    }
 };
 
+/** \brief A set of packages or versions, indexed by their IDs */
+class APT_HIDDEN MatchSet
+{
+   std::vector<uint64_t> words;
+   size_t count;
+
+   public:
+   MatchSet(size_t count, bool value) : words((count + 63) / 64, value ? ~uint64_t{0} : 0), count(count)
+   {
+      clearTail();
+   }
+   bool test(size_t i) const { return i < count && (words[i / 64] >> (i % 64)) & 1; }
+   void set(size_t i) { words[i / 64] |= uint64_t{1} << (i % 64); }
+   void reset(size_t i) { words[i / 64] &= ~(uint64_t{1} << (i % 64)); }
+   MatchSet &operator&=(MatchSet const &o)
+   {
+      for (size_t i = 0; i < words.size(); ++i)
+	 words[i] &= o.words[i];
+      return *this;
+   }
+   MatchSet &operator|=(MatchSet const &o)
+   {
+      for (size_t i = 0; i < words.size(); ++i)
+	 words[i] |= o.words[i];
+      return *this;
+   }
+   MatchSet &flip()
+   {
+      for (auto &w : words)
+	 w = ~w;
+      clearTail();
+      return *this;
+   }
+
+   private:
+   void clearTail()
+   {
+      if (count % 64 != 0)
+	 words.back() &= (uint64_t{1} << (count % 64)) - 1;
+   }
+};
+
+/**
+ * \brief Evaluates a parsed pattern once for the whole cache
+ *
+ * On the first query, the matching packages and versions are computed for
+ * each node of the pattern in turn, starting at the leaves: and, or and not
+ * are set operations on the results of their arguments, and nodes rendered
+ * the same way share their results. Queries are then answered by a lookup.
+ * Nodes depending on the state of the depcache like ?broken or ?garbage,
+ * and all nodes containing them, are evaluated on each query instead, so
+ * a compiled pattern stays valid across changes of the depcache.
+ */
+class APT_HIDDEN CompiledPattern : public Matcher
+{
+   pkgCache *cache;
+   std::unique_ptr<Matcher> pattern;
+   std::map<Matcher const *, std::string> keys;
+   std::unordered_map<std::string, MatchSet> packageMemo;
+   std::unordered_map<std::string, MatchSet> versionMemo;
+   MatchSet const *packageResult = nullptr;
+   MatchSet const *versionResult = nullptr;
+   std::unordered_set<Matcher const *> stateful;
+
+   bool markStateful(Matcher const &M);
+   bool matches(Matcher &M, pkgCache::PkgIterator const &Pkg);
+   bool matches(Matcher &M, pkgCache::VerIterator const &Ver);
+   std::string key(Matcher const &M) const;
+   MatchSet const &packages(Matcher &M);
+   MatchSet const &versions(Matcher &M);
+   MatchSet computePackages(Matcher &M);
+   MatchSet computeVersions(Matcher &M);
+   MatchSet anyVersion(MatchSet const &Versions);
+
+   public:
+   CompiledPattern(pkgCache *cache, std::unique_ptr<Matcher> pattern, std::map<Matcher const *, std::string> keys)
+      : cache(cache), pattern(std::move(pattern)), keys(std::move(keys))
+   {
+      markStateful(*this->pattern);
+   }
+   bool operator()(pkgCache::PkgIterator const &Pkg) override;
+   bool operator()(pkgCache::GrpIterator const &Grp) override { return (*pattern)(Grp); }
+   bool operator()(pkgCache::VerIterator const &Ver) override;
+};
 } // namespace Patterns
 } // namespace Internal
 } // namespace APT
@@ -30,6 +30,7 @@
 #include <cstring>
 #include <list>
 #include <string>
+#include <unordered_set>
 #include <vector>
 #include <regex.h>
 
@@ -86,7 +87,9 @@ bool CacheSetHelper::PackageFromTask(PackageContainerInterface * const pci, pkgC
 		return false;
 	}
 
-	bool found = false;
+	// check the records in file order, but select the packages in the usual order
+	std::vector<pkgCache::PkgIterator> pkgs;
+	std::vector<pkgCache::VerFileIterator> records;
 	for (pkgCache::GrpIterator Grp = Cache->GrpBegin(); Grp.end() == false; ++Grp) {
 		pkgCache::PkgIterator Pkg = Grp.FindPkg(arch);
 		if (Pkg.end() == true)
@@ -94,24 +97,34 @@ bool CacheSetHelper::PackageFromTask(PackageContainerInterface * const pci, pkgC
 		pkgCache::VerIterator ver = Cache[Pkg].CandidateVerIter(Cache);
 		if(ver.end() == true)
 			continue;
+		pkgs.push_back(Pkg);
+		records.push_back(ver.FileList());
+	}
 
-		pkgRecords::Parser &parser = Recs.Lookup(ver.FileList());
+	std::unordered_set<pkgCache::VerFile const *> inTask;
+	Recs.ForEach(records, [&](pkgCache::VerFileIterator const &vf, pkgRecords::Parser &parser) {
 		const char *start, *end;
 		parser.GetRec(start,end);
 		unsigned int const length = end - start;
 		if (unlikely(length == 0))
-		   continue;
+		   return true;
 		char buf[length];
 		strncpy(buf, start, length);
 		buf[length-1] = '\0';
-		if (regexec(&Pattern, buf, 0, 0, 0) != 0)
-			continue;
+		if (regexec(&Pattern, buf, 0, 0, 0) == 0)
+			inTask.insert(static_cast<pkgCache::VerFile const *>(vf));
+		return true;
+	});
+	regfree(&Pattern);
 
-		pci->insert(Pkg);
-		showPackageSelection(Pkg, CacheSetHelper::TASK, pattern);
+	bool found = false;
+	for (size_t i = 0; i < pkgs.size(); ++i) {
+		if (inTask.find(static_cast<pkgCache::VerFile const *>(records[i])) == inTask.end())
+			continue;
+		pci->insert(pkgs[i]);
+		showPackageSelection(pkgs[i], CacheSetHelper::TASK, pattern);
 		found = true;
 	}
-	regfree(&Pattern);
 
 	if (found == false) {
 		canNotFindPackage(CacheSetHelper::TASK, pci, Cache, pattern);
@@ -24,6 +24,7 @@
 #include <apt-pkg/error.h>
 #include <apt-pkg/fileutl.h>
 #include <apt-pkg/macros.h>
+#include <apt-pkg/mmap.h>
 #include <apt-pkg/strutl.h>
 
 #include <cctype>
@@ -35,6 +36,7 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <fstream>
 #include <iterator>
 #include <numeric>
@@ -194,6 +196,8 @@ static void checkFindConfigOptionType(char const * const name, ConfigType const
    checkFindConfigOptionTypeInternal(name, type);
 }
 									/*}}}*/
+// #include and #x-apt-configure-index read files outside of the parsed ones
+static std::atomic<unsigned long> FileDirectivesRead{0};
 static bool LoadConfigurationIndex(std::string const &filename)		/*{{{*/
 {
    apt_known_config.clear();
@@ -249,12 +253,8 @@ Configuration::Configuration(const Item *Root) : Root((Item *)Root), ToFree(fals
 // Configuration::~Configuration - Destructor				/*{{{*/
 // ---------------------------------------------------------------------
 /* */
-Configuration::~Configuration()
+static void DeleteTree(Configuration::Item *Top)
 {
-   if (ToFree == false)
-      return;
-
-   Item *Top = Root;
    for (; Top != 0;)
    {
       if (Top->Child != 0)
@@ -265,17 +265,23 @@ Configuration::~Configuration()
 
       while (Top != 0 && Top->Next == 0)
       {
-	 Item *Parent = Top->Parent;
+	 Configuration::Item *Parent = Top->Parent;
 	 delete Top;
 	 Top = Parent;
       }
       if (Top != 0)
       {
-	 Item *Next = Top->Next;
+	 Configuration::Item *Next = Top->Next;
 	 delete Top;
 	 Top = Next;
       }
    }
+}
+Configuration::~Configuration()
+{
+   if (ToFree == false)
+      return;
+   DeleteTree(Root);
 }
 									/*}}}*/
 // Configuration::Lookup - Lookup a single item				/*{{{*/
@@ -1094,6 +1100,8 @@ bool ReadConfigFile(Configuration &Conf,const string &FName,bool const &AsSectio
 	       if (ParentTag.empty() == false)
 		  return _error->Error(_("Syntax error %s:%u: Directives can only be done at the top level"),FName.c_str(),CurLine);
 	       Tag.erase(Tag.begin());
+	       if (Tag != "clear")
+		  ++FileDirectivesRead;
 	       if (Tag == "clear")
 		  Conf.Clear(Word);
 	       else if (Tag == "include")
@@ -1168,6 +1176,11 @@ bool ReadConfigFile(Configuration &Conf,const string &FName,bool const &AsSectio
    return true;
 }
 									/*}}}*/
+unsigned long ConfigFileDirectivesRead()
+{
+   return FileDirectivesRead;
+}
+									/*}}}*/
 // ReadConfigDir - Read a directory of config files			/*{{{*/
 // ---------------------------------------------------------------------
 /* */
@@ -1268,3 +1281,131 @@ bool Configuration::SectionInSubTree(char const *const SubTree, std::string_view
    return ConfigValueInSubTree(this, SubTree, Needle.substr(sub + 1));
 }
 									/*}}}*/
+// Configuration::*Snapshot - Store the whole tree in a file		/*{{{*/
+// ---------------------------------------------------------------------
+/* The items are stored in depth-first order, each with the index of its
+   parent (0 is the root), followed by all tags and values in one block.
+   The key identifies the input the tree was built from. */
+namespace
+{
+struct ConfigSnapshotHeader
+{
+   char Signature[8];
+   uint64_t Key;
+   uint32_t ItemCount;
+   uint32_t StringSize;
+};
+struct ConfigSnapshotItem
+{
+   uint32_t Parent;
+   uint32_t TagSize;
+   uint32_t ValueSize;
+};
+constexpr char ConfigSnapshotSignature[8] = {'A', 'P', 'T', 'C', 'N', 'F', '0', '1'};
+} // namespace
+bool Configuration::ReadSnapshot(std::string const &File, uint64_t const Key)
+{
+   if (ToFree == false || RealFileExists(File) == false)
+      return false;
+   /* Opening it like a configuration file doesn't query the compressors,
+      which would set their defaults in the tree replaced here and cache
+      them before the configuration is known */
+   _error->PushToStack();
+   FileFd Snapshot;
+   std::unique_ptr<MMap> Map;
+   if (OpenConfigurationFileFd(File, Snapshot) && Snapshot.FileSize() >= sizeof(ConfigSnapshotHeader))
+      Map.reset(new MMap(Snapshot, MMap::ReadOnly));
+   _error->RevertToStack();
+   if (Map == nullptr || Map->validData() == false)
+      return false;
+
+   auto const Start = static_cast<char const *>(Map->Data());
+   ConfigSnapshotHeader Header;
+   memcpy(&Header, Start, sizeof(Header));
+   if (memcmp(Header.Signature, ConfigSnapshotSignature, sizeof(Header.Signature)) != 0 ||
+       Header.Key != Key ||
+       Map->Size() != sizeof(Header) + uint64_t{Header.ItemCount} * sizeof(ConfigSnapshotItem) + Header.StringSize)
+      return false;
+
+   auto const Records = Start + sizeof(Header);
+   char const *Strings = Records + Header.ItemCount * sizeof(ConfigSnapshotItem);
+   char const *const StringsEnd = Strings + Header.StringSize;
+   // the last child of each item, so that items are appended in order
+   std::vector<Item *> Items{new Item};
+   std::vector<Item *> LastChild{nullptr};
+   Items.reserve(Header.ItemCount + 1);
+   LastChild.reserve(Header.ItemCount + 1);
+   for (uint32_t I = 0; I < Header.ItemCount; ++I)
+   {
+      ConfigSnapshotItem Record;
+      memcpy(&Record, Records + I * sizeof(Record), sizeof(Record));
+      if (Record.Parent >= Items.size() || uint64_t{Record.TagSize} + Record.ValueSize > uint64_t(StringsEnd - Strings))
+      {
+	 DeleteTree(Items[0]);
+	 return false;
+      }
+      auto const Itm = new Item;
+      Itm->Tag.assign(Strings, Record.TagSize);
+      Strings += Record.TagSize;
+      Itm->Value.assign(Strings, Record.ValueSize);
+      Strings += Record.ValueSize;
+      Itm->Parent = Items[Record.Parent];
+      if (LastChild[Record.Parent] == nullptr)
+	 Itm->Parent->Child = Itm;
+      else
+	 LastChild[Record.Parent]->Next = Itm;
+      LastChild[Record.Parent] = Itm;
+      Items.push_back(Itm);
+      LastChild.push_back(nullptr);
+   }
+
+   DeleteTree(Root);
+   Root = Items[0];
+   return true;
+}
+bool Configuration::WriteSnapshot(std::string const &File, uint64_t const Key) const
+{
+   std::vector<ConfigSnapshotItem> Records;
+   std::string Strings;
+   std::unordered_map<Item const *, uint32_t> Index{{Root, 0}};
+   for (Item const *Top = Root->Child; Top != nullptr;)
+   {
+      Index.emplace(Top, Records.size() + 1);
+      Records.push_back({Index[Top->Parent], static_cast<uint32_t>(Top->Tag.size()), static_cast<uint32_t>(Top->Value.size())});
+      Strings.append(Top->Tag).append(Top->Value);
+
+      if (Top->Child != nullptr)
+      {
+	 Top = Top->Child;
+	 continue;
+      }
+      while (Top != nullptr && Top->Next == nullptr)
+      {
+	 Top = Top->Parent;
+	 if (Top == Root)
+	    Top = nullptr;
+      }
+      if (Top != nullptr)
+	 Top = Top->Next;
+   }
+
+   ConfigSnapshotHeader Header{};
+   memcpy(Header.Signature, ConfigSnapshotSignature, sizeof(Header.Signature));
+   Header.Key = Key;
+   Header.ItemCount = Records.size();
+   Header.StringSize = Strings.size();
+
+   // not being able to write a snapshot (e.g. as a user) is no error
+   _error->PushToStack();
+   FileFd Snapshot(File, FileFd::WriteAtomic, FileFd::None, 0644);
+   bool const Okay = Snapshot.IsOpen() &&
+		     Snapshot.Write(&Header, sizeof(Header)) &&
+		     Snapshot.Write(Records.data(), Records.size() * sizeof(Records[0])) &&
+		     Snapshot.Write(Strings.data(), Strings.size()) &&
+		     Snapshot.Close();
+   if (Okay == false)
+      Snapshot.OpFail();
+   _error->RevertToStack();
+   return Okay;
+}
+									/*}}}*/
@@ -29,6 +29,7 @@
 
 #include <regex.h>
 
+#include <cstdint>
 #include <iostream>
 #include <string>
 #include <string_view>
@@ -120,6 +121,9 @@ class APT_PUBLIC Configuration
 
 #ifdef APT_COMPILING_APT
    bool SectionInSubTree(char const *const SubTree, std::string_view Needle);
+   /** \brief replace the whole tree by a snapshot written with the same key */
+   bool ReadSnapshot(std::string const &File, uint64_t Key);
+   bool WriteSnapshot(std::string const &File, uint64_t Key) const;
 #endif
    explicit Configuration(const Item *Root);
    Configuration();
@@ -154,4 +158,9 @@ APT_PUBLIC bool ReadConfigDir(Configuration &Conf,const std::string &Dir,
 		   bool const &AsSectional = false,
 		   unsigned const &Depth = 0);
 
+#ifdef APT_COMPILING_APT
+/** \brief number of directives read so far which involve other files */
+APT_HIDDEN unsigned long ConfigFileDirectivesRead();
+#endif
+
 #endif
@@ -1797,6 +1797,17 @@ bool InternalOpen(int const iFd, unsigned int const Mode) override
 #endif
 };
 									/*}}}*/
+#if defined(HAVE_ZSTD) || defined(HAVE_LZMA)
+// CompressorThreads - Number of threads an encoder should use		/*{{{*/
+static unsigned int CompressorThreads(APT::Configuration::Compressor const &compressor)
+{
+   int const threads = _config->FindI(std::string("APT::Compressor::").append(compressor.Name).append("::Threads").c_str(), 1);
+   if (threads == 0)
+      return std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+   return std::max(threads, 1);
+}
+									/*}}}*/
+#endif
 class APT_HIDDEN ZstdFileFdPrivate : public FileFdPrivate		/*{{{*/
 {
 #ifdef HAVE_ZSTD
@@ -1818,6 +1829,9 @@ class APT_HIDDEN ZstdFileFdPrivate : public FileFdPrivate		/*{{{*/
       {
 	 cctx = ZSTD_createCStream();
 	 res = ZSTD_initCStream(cctx, findLevel(compressor.CompressArgs));
+	 // libzstd without thread support refuses this, which is fine
+	 if (auto const threads = CompressorThreads(compressor); ZSTD_isError(res) == false && threads > 1)
+	    ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, threads);
 	 zstd_buffer.reset(APT_BUFFER_SIZE);
       }
       else
@@ -2099,7 +2113,16 @@ bool InternalOpen(int const iFd, unsigned int const Mode) override
       uint32_t const xzlevel = findXZlevel(compressor.CompressArgs);
       if (compressor.Name == "xz")
       {
-	 if (lzma_easy_encoder(&lzma->stream, xzlevel, LZMA_CHECK_CRC64) != LZMA_OK)
+	 lzma_mt mt{};
+	 mt.threads = CompressorThreads(compressor);
+	 mt.preset = xzlevel;
+	 mt.check = LZMA_CHECK_CRC64;
+	 if (mt.threads > 1)
+	 {
+	    if (lzma_stream_encoder_mt(&lzma->stream, &mt) != LZMA_OK)
+	       return false;
+	 }
+	 else if (lzma_easy_encoder(&lzma->stream, xzlevel, LZMA_CHECK_CRC64) != LZMA_OK)
 	    return false;
       }
       else
@@ -23,11 +23,18 @@
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <openssl/evp.h>
@@ -349,6 +356,14 @@ class PrivateHashes
       return true;
    }
 
+   std::vector<EVP_MD_CTX *> EnabledContexts() const
+   {
+      std::vector<EVP_MD_CTX *> enabled;
+      std::copy_if(contexts.begin(), contexts.end(), std::back_inserter(enabled),
+		   [](EVP_MD_CTX *context) { return context != nullptr; });
+      return enabled;
+   }
+
    std::string HexDigest(HashAlgo const &algo)
    {
       auto Size = EVP_MD_size(algo.evpLink());
@@ -406,12 +421,146 @@ class PrivateHashes
    }
 };
 									/*}}}*/
+// ParallelHashes - Feed each algorithm from its own thread		/*{{{*/
+/* All enabled algorithms walk the same block at the same time, so hashing
+   with several of them takes about as long as the slowest one instead of
+   the sum of all of them. The caller may read the next block meanwhile. */
+class ParallelHashes
+{
+   // below this size starting the threads isn't worth it
+   static constexpr unsigned long long MinSize = 1024 * 1024;
+
+   std::vector<std::thread> Workers;
+   std::mutex Lock;
+   std::condition_variable Wakeup, Finished;
+   unsigned char const *Data = nullptr;
+   size_t Size = 0;
+   unsigned long long Generation = 0;
+   size_t Pending = 0;
+   bool Stop = false;
+
+   void Worker(EVP_MD_CTX * const Context)
+   {
+      unsigned long long Seen = 0;
+      std::unique_lock<std::mutex> Guard(Lock);
+      while (true)
+      {
+	 Wakeup.wait(Guard, [&]() { return Stop || Generation != Seen; });
+	 if (Stop)
+	    return;
+	 Seen = Generation;
+	 auto const Block = Data;
+	 auto const BlockSize = Size;
+	 Guard.unlock();
+	 EVP_DigestUpdate(Context, Block, BlockSize);
+	 Guard.lock();
+	 if (--Pending == 0)
+	    Finished.notify_one();
+      }
+   }
+
+   explicit ParallelHashes(std::vector<EVP_MD_CTX *> const &Contexts)
+   {
+      for (auto const Context : Contexts)
+	 Workers.emplace_back(&ParallelHashes::Worker, this, Context);
+   }
+
+   public:
+   static constexpr size_t BlockSize = 1024 * 1024;
+
+   /* Returns nullptr if it makes no sense to use threads for hashing
+      ExpectedSize bytes, or if they can't be created (e.g. in a sandbox) */
+   static std::unique_ptr<ParallelHashes> Create(PrivateHashes const * const d, unsigned long long const ExpectedSize)
+   {
+      if (ExpectedSize < MinSize)
+	 return nullptr;
+      auto const Contexts = d->EnabledContexts();
+      if (Contexts.size() < 2 || std::thread::hardware_concurrency() < 2 ||
+	  _config->FindB("APT::Hashes::Parallel", true) == false)
+	 return nullptr;
+      try
+      {
+	 return std::unique_ptr<ParallelHashes>(new ParallelHashes(Contexts));
+      }
+      catch (std::system_error const &)
+      {
+	 return nullptr;
+      }
+   }
+
+   void Start(unsigned char const * const NewData, size_t const NewSize)
+   {
+      std::unique_lock<std::mutex> Guard(Lock);
+      Finished.wait(Guard, [&]() { return Pending == 0; });
+      Data = NewData;
+      Size = NewSize;
+      Pending = Workers.size();
+      ++Generation;
+      Wakeup.notify_all();
+   }
+   void Wait()
+   {
+      std::unique_lock<std::mutex> Guard(Lock);
+      Finished.wait(Guard, [&]() { return Pending == 0; });
+   }
+
+   ~ParallelHashes()
+   {
+      Wait();
+      {
+	 std::lock_guard<std::mutex> Guard(Lock);
+	 Stop = true;
+	 Wakeup.notify_all();
+      }
+      for (auto &W : Workers)
+	 W.join();
+   }
+};
+									/*}}}*/
+// ReadAndHash - Shared implementation of the AddFD variants		/*{{{*/
+/* Read is called as Read(Buffer, Wanted, Got) and fails on errors and on
+   short reads if ToEOF is false. ExpectedSize is a hint for ToEOF. */
+template <class ReadFunc>
+static bool ReadAndHash(PrivateHashes * const d, unsigned long long Size, bool const ToEOF,
+			unsigned long long const ExpectedSize, ReadFunc const &Read)
+{
+   // declared first, so that it outlives all threads working on it
+   std::vector<unsigned char> Buf;
+   auto Parallel = ParallelHashes::Create(d, ToEOF ? ExpectedSize : Size);
+   size_t const BlockSize = Parallel == nullptr ? APT_BUFFER_SIZE : ParallelHashes::BlockSize;
+   // with threads we read into one half while the other half is hashed
+   Buf.resize(Parallel == nullptr ? BlockSize : 2 * BlockSize);
+   unsigned char *Block = Buf.data();
+   while (Size != 0 || ToEOF)
+   {
+      unsigned long long n = BlockSize;
+      if (!ToEOF) n = std::min(Size, n);
+      unsigned long long a = 0;
+      if (Read(Block, n, a) == false)
+	 return false;
+      if (ToEOF && a == 0) // EOF
+	 break;
+      Size -= a;
+      d->FileSize += a;
+      if (Parallel == nullptr)
+	 d->Write(Block, a);
+      else
+      {
+	 Parallel->Start(Block, a);
+	 Block = (Block == Buf.data()) ? Buf.data() + BlockSize : Buf.data();
+      }
+   }
+   return true;
+}
+									/*}}}*/
 // Hashes::Add* - Add the contents of data or FD			/*{{{*/
 bool Hashes::Add(const unsigned char * const Data, unsigned long long const Size)
 {
    if (Size != 0)
    {
-      if (not d->Write(Data, Size))
+      if (auto Parallel = ParallelHashes::Create(d, Size); Parallel != nullptr)
+	 Parallel->Start(Data, Size);
+      else if (not d->Write(Data, Size))
 	 return false;
       d->FileSize += Size;
    }
@@ -419,46 +568,30 @@ bool Hashes::Add(const unsigned char * const Data, unsigned long long const Size
 }
 bool Hashes::AddFD(int const Fd,unsigned long long Size)
 {
-   std::array<unsigned char, APT_BUFFER_SIZE> Buf;
    bool const ToEOF = (Size == UntilEOF);
-   while (Size != 0 || ToEOF)
-   {
-      decltype(Size) n = Buf.size();
-      if (!ToEOF) n = std::min(Size, n);
-      ssize_t const Res = read(Fd,Buf.data(),n);
+   struct stat St;
+   unsigned long long const Expected = (ToEOF && fstat(Fd, &St) == 0) ? St.st_size : 0;
+   return ReadAndHash(d, Size, ToEOF, Expected, [&](unsigned char *Buf, unsigned long long n, unsigned long long &a) {
+      ssize_t const Res = read(Fd, Buf, n);
       if (Res < 0 || (!ToEOF && Res != (ssize_t) n)) // error, or short read
 	 return false;
-      if (ToEOF && Res == 0) // EOF
-	 break;
-      Size -= Res;
-      if (Add(Buf.data(), Res) == false)
-	 return false;
-   }
-   return true;
+      a = Res;
+      return true;
+   });
 }
 bool Hashes::AddFD(FileFd &Fd,unsigned long long Size)
 {
-   std::array<unsigned char, APT_BUFFER_SIZE> Buf;
    bool const ToEOF = (Size == 0);
-   while (Size != 0 || ToEOF)
-   {
-      decltype(Size) n = Buf.size();
-      if (!ToEOF) n = std::min(Size, n);
-      decltype(Size) a = 0;
-      if (Fd.Read(Buf.data(), n, &a) == false) // error
+   // the size on disk is good enough as a hint even for compressed files
+   struct stat St;
+   unsigned long long const Expected = (ToEOF && fstat(Fd.Fd(), &St) == 0) ? St.st_size : 0;
+   return ReadAndHash(d, Size, ToEOF, Expected, [&](unsigned char *Buf, unsigned long long n, unsigned long long &a) {
+      if (Fd.Read(Buf, n, &a) == false) // error
 	 return false;
-      if (ToEOF == false)
-      {
-	 if (a != n) // short read
-	    return false;
-      }
-      else if (a == 0) // EOF
-	 break;
-      Size -= a;
-      if (Add(Buf.data(), a) == false)
+      if (ToEOF == false && a != n) // short read
 	 return false;
-   }
-   return true;
+      return true;
+   });
 }
 									/*}}}*/
 
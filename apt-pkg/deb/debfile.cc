@@ -28,11 +28,15 @@
 #include <apt-pkg/tagfile.h>
 
 #include <algorithm>
+#include <array>
+#include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <apti18n.h>
 									/*}}}*/
@@ -154,6 +158,136 @@ bool debDebFile::ExtractTarMember(pkgDirStream &Stream,const char *Name)
    return Tar.Go(Stream);
 }
 									/*}}}*/
+// DebFile::WriteDecompressed - Copy with an uncompressed data member	/*{{{*/
+// ---------------------------------------------------------------------
+/* The size of the decompressed data isn't known upfront, so the header of
+   the data member is written with a placeholder and fixed up afterwards.
+   Decompressors read until the end of the file they are given, so if the
+   compressed data member isn't the last thing in the archive (as it has
+   padding or other members behind it) it is copied to a temporary file
+   next to the target first, so it ends up on the same filesystem. */
+static bool WriteARHeader(FileFd &Out, std::string const &Name, ARArchive::Member const &Member, unsigned long long const Size)
+{
+   char Head[61];
+   if (snprintf(Head, sizeof(Head), "%-16s%-12lu%-6lu%-6lu%-8lo%-10llu`\n", Name.c_str(),
+		Member.MTime, Member.UID, Member.GID, Member.Mode, Size) != 60)
+      return _error->Error("Member %s can't be represented in an ar header", Name.c_str());
+   return Out.Write(Head, 60);
+}
+static bool CopyBytes(FileFd &From, FileFd &To, unsigned long long Size)
+{
+   std::array<char, APT_BUFFER_SIZE> Buffer;
+   while (Size != 0)
+   {
+      auto const Count = std::min<unsigned long long>(Size, Buffer.size());
+      if (not From.Read(Buffer.data(), Count) || not To.Write(Buffer.data(), Count))
+	 return false;
+      Size -= Count;
+   }
+   return true;
+}
+bool debDebFile::WriteDecompressed(std::string const &Target)
+{
+   auto const Compressors = APT::Configuration::getCompressors();
+   ARArchive::Member const *Data = nullptr;
+   auto Compressor = Compressors.cend();
+   for (auto c = Compressors.cbegin(); c != Compressors.cend(); ++c)
+   {
+      if (c->Extension.empty())
+	 continue;
+      Data = AR.FindMember(std::string("data.tar").append(c->Extension).c_str());
+      if (Data == nullptr)
+	 continue;
+      Compressor = c;
+      break;
+   }
+   if (Data == nullptr)
+      return _error->Error("Archive %s has no compressed data member", File.Name().c_str());
+
+   FileFd Out;
+   if (not Out.Open(Target, FileFd::WriteOnly | FileFd::Create | FileFd::Exclusive, 0644))
+      return false;
+   auto const Fail = [&]() {
+      Out.Close();
+      RemoveFile("WriteDecompressed", Target);
+      return false;
+   };
+   if (not Out.Write("!<arch>\n", 8))
+      return Fail();
+
+   // the member list is in reverse, but dpkg insists on the original order
+   std::vector<ARArchive::Member const *> Members;
+   for (auto Member = AR.Members(); Member != nullptr; Member = Member->Next)
+      Members.push_back(Member);
+   std::sort(Members.begin(), Members.end(), [](auto const A, auto const B) { return A->Start < B->Start; });
+
+   std::array<char, APT_BUFFER_SIZE> Buffer;
+   for (auto const Member : Members)
+   {
+      unsigned long long Size = Member->Size;
+      if (Member != Data)
+      {
+	 if (not WriteARHeader(Out, Member->Name, *Member, Size) ||
+	     not File.Seek(Member->Start) || not CopyBytes(File, Out, Size))
+	    return Fail();
+      }
+      else
+      {
+	 auto const HeaderStart = Out.Tell();
+	 if (not WriteARHeader(Out, "data.tar", *Member, 0) || not File.Seek(Member->Start))
+	    return Fail();
+
+	 FileFd Compressed;
+	 std::unique_ptr<FileFd> Temp;
+	 if (Member->Start + Member->Size == File.FileSize())
+	 {
+	    if (not Compressed.OpenDescriptor(File.Fd(), FileFd::ReadOnly, *Compressor, false))
+	       return Fail();
+	 }
+	 else
+	 {
+	    std::string TempName = Target + ".data-XXXXXX";
+	    int const TempFd = mkstemp(TempName.data());
+	    if (TempFd == -1)
+	    {
+	       _error->Errno("mkstemp", _("Unable to mkstemp %s"), TempName.c_str());
+	       return Fail();
+	    }
+	    unlink(TempName.c_str());
+	    Temp = std::make_unique<FileFd>();
+	    if (not Temp->OpenDescriptor(TempFd, FileFd::ReadWrite, FileFd::None, true) ||
+		not CopyBytes(File, *Temp, Member->Size) || not Temp->Seek(0) ||
+		not Compressed.OpenDescriptor(Temp->Fd(), FileFd::ReadOnly, *Compressor, false))
+	       return Fail();
+	 }
+
+	 Size = 0;
+	 while (true)
+	 {
+	    unsigned long long Actual = 0;
+	    if (not Compressed.Read(Buffer.data(), Buffer.size(), &Actual))
+	       return Fail();
+	    if (Actual == 0)
+	       break;
+	    if (not Out.Write(Buffer.data(), Actual))
+	       return Fail();
+	    Size += Actual;
+	 }
+	 Compressed.Close();
+
+	 auto const HeaderEnd = Out.Tell();
+	 if (not Out.Seek(HeaderStart) || not WriteARHeader(Out, "data.tar", *Member, Size) ||
+	     not Out.Seek(HeaderEnd))
+	    return Fail();
+      }
+      if (Size % 2 != 0 && not Out.Write("\n", 1))
+	 return Fail();
+   }
+   if (not Out.Close())
+      return Fail();
+   return true;
+}
+									/*}}}*/
 // DebFile::ExtractArchive - Extract the archive data itself		/*{{{*/
 // ---------------------------------------------------------------------
 /* Simple wrapper around DebFile::ExtractTarMember. */
@@ -49,6 +49,16 @@ class APT_PUBLIC debDebFile
    bool ExtractArchive(pkgDirStream &Stream);
    const ARArchive::Member *GotoMember(const char *Name);
    inline FileFd &GetFile() {return File;};
+#ifdef APT_COMPILING_APT
+   /** \brief write a copy of this archive with an uncompressed data member
+    *
+    *  All other members are copied verbatim, so the result can be
+    *  unpacked by dpkg without decompressing it again.
+    *
+    *  \param Target is the file to create, it must not exist yet
+    */
+   APT_HIDDEN bool WriteDecompressed(std::string const &Target);
+#endif
    
    explicit debDebFile(FileFd &File);
 };
@@ -17,6 +17,7 @@
 #include <apt-pkg/configuration.h>
 #include <apt-pkg/deblistparser.h>
 #include <apt-pkg/error.h>
+#include <apt-pkg/fileutl.h>
 #include <apt-pkg/hashes.h>
 #include <apt-pkg/macros.h>
 #include <apt-pkg/pkgcache.h>
@@ -49,8 +50,8 @@ static const debListParser::WordList PrioList[] = {
 /* Provide an architecture and only this one and "all" will be accepted
    in Step(), if no Architecture is given we will accept every arch
    we would accept in general with checkArchitecture() */
-debListParser::debListParser(FileFd *File) :
-   pkgCacheListParser(), Tags(File)
+debListParser::debListParser(FileFd *File, unsigned long long const BufferSize) :
+   pkgCacheListParser(), Tags(File, BufferSize)
 {
    // this dance allows an empty value to override the default
    if (_config->Exists("pkgCacheGen::ForceEssential"))
@@ -373,6 +374,15 @@ uint32_t debListParser::VersionHash()
    }
 
    return Result;
+}
+									/*}}}*/
+// StatusListParser::debStatusListParser - Constructor			/*{{{*/
+// ---------------------------------------------------------------------
+/* The status file is parsed completely anyway, so read it in one go
+   instead of refilling (and moving around) a small buffer over and over */
+debStatusListParser::debStatusListParser(FileFd *File) :
+   debListParser(File, std::max<unsigned long long>(APT_BUFFER_SIZE, File->Size()))
+{
 }
 									/*}}}*/
 // StatusListParser::ParseStatus - Parse the status field		/*{{{*/
@@ -91,7 +91,7 @@ class APT_HIDDEN debListParser : public pkgCacheListParser
 
    APT_PUBLIC static const char *ConvertRelation(const char *I,unsigned int &Op);
 
-   explicit debListParser(FileFd *File);
+   explicit debListParser(FileFd *File, unsigned long long const BufferSize = APT_BUFFER_SIZE);
    ~debListParser() override;
 
 #ifdef APT_COMPILING_APT
@@ -132,7 +132,6 @@ class APT_HIDDEN debStatusListParser : public debListParser
 {
  public:
    bool ParseStatus(pkgCache::PkgIterator &Pkg,pkgCache::VerIterator &Ver) override;
-   explicit debStatusListParser(FileFd *File)
-      : debListParser(File) {};
+   explicit debStatusListParser(FileFd *File);
 };
 #endif
@@ -9,8 +9,10 @@
 // Includes								/*{{{*/
 #include <config.h>
 
+#include <apt-pkg/aptconfiguration.h>
 #include <apt-pkg/cachefile.h>
 #include <apt-pkg/configuration.h>
+#include <apt-pkg/debfile.h>
 #include <apt-pkg/debsystem.h>
 #include <apt-pkg/depcache.h>
 #include <apt-pkg/dpkgpm.h>
@@ -38,6 +40,7 @@
 #include <sys/ioctl.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -46,6 +49,7 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstring>
 #include <iostream>
 #include <map>
@@ -53,6 +57,8 @@
 #include <set>
 #include <sstream>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <type_traits>
 #include <unordered_set>
 #include <utility>
@@ -112,7 +118,8 @@ public:
 			dpkgbuf_pos(0), term_out(NULL), history_out(NULL),
 			progress(NULL), tt_is_valid(false), master(-1),
 			slave(NULL), protect_slave_from_dying(-1),
-			direct_stdin(false)
+			direct_stdin(false), trigger_runs(0), trigger_deferrals(0),
+			debug_progress(false)
    {
       dpkgbuf[0] = '\0';
    }
@@ -141,6 +148,17 @@ public:
    sigset_t original_sigmask;
 
    bool direct_stdin;
+
+   // trigger statistics: packages with pending triggers, those of them
+   // already counted as deferred, how often dpkg processed triggers and
+   // how often pending triggers were left for later
+   std::set<std::string> triggers_pending;
+   std::set<std::string> triggers_deferred;
+   unsigned long trigger_runs;
+   unsigned long trigger_deferrals;
+
+   // looked up once per Go instead of for each status-fd line
+   bool debug_progress;
 };
 									/*}}}*/
 namespace
@@ -572,7 +590,7 @@ void pkgDPkgPM::DoTerminalPty(int master)
 // DPkgPM::ProcessDpkgStatusBuf						/*{{{*/
 void pkgDPkgPM::ProcessDpkgStatusLine(char *line)
 {
-   bool const Debug = _config->FindB("Debug::pkgDPkgProgressReporting",false);
+   bool const Debug = d->debug_progress;
    if (Debug == true)
       std::clog << "got from dpkg '" << line << "'" << std::endl;
 
@@ -590,8 +608,20 @@ void pkgDPkgPM::ProcessDpkgStatusLine(char *line)
    // A dpkg error message may contain additional ":" (like
    //  "failed in buffer_write(fd) (10, ret=-1): backend dpkg-deb ..."
    // so we need to ensure to not split too much
-   std::vector<std::string> list = StringSplit(line, ": ", 4);
-   if(list.size() < 3)
+   std::array<std::string_view, 4> list;
+   size_t listSize = 0;
+   for (std::string_view rest = line; listSize < list.size(); ++listSize)
+   {
+      auto const pos = (listSize == list.size() - 1) ? std::string_view::npos : rest.find(": ");
+      list[listSize] = rest.substr(0, pos);
+      if (pos == std::string_view::npos)
+      {
+	 ++listSize;
+	 break;
+      }
+      rest.remove_prefix(pos + 2);
+   }
+   if(listSize < 3)
    {
       if (Debug == true)
 	 std::clog << "ignoring line: not enough ':'" << std::endl;
@@ -629,14 +659,15 @@ void pkgDPkgPM::ProcessDpkgStatusLine(char *line)
 	 */
       if(action == "error")
       {
-         d->progress->Error(pkgname, PackagesDone, PackagesTotal, list[3]);
+         std::string const errormsg{list[3]};
+         d->progress->Error(pkgname, PackagesDone, PackagesTotal, errormsg);
          ++pkgFailures;
-         WriteApportReport(pkgname.c_str(), list[3].c_str());
+         WriteApportReport(pkgname.c_str(), errormsg.c_str());
          return;
       }
       else if(action == "conffile-prompt")
       {
-         d->progress->ConffilePrompt(pkgname, PackagesDone, PackagesTotal, list[3]);
+         d->progress->ConffilePrompt(pkgname, PackagesDone, PackagesTotal, std::string{list[3]});
          return;
       }
    } else {
@@ -645,6 +676,22 @@ void pkgDPkgPM::ProcessDpkgStatusLine(char *line)
       return;
    }
 
+   // triggers are tracked by the name dpkg uses as they are usually
+   // processed for packages which are not part of the transaction
+   if (prefix == "processing" && action == "trigproc")
+   {
+      ++d->trigger_runs;
+      d->triggers_pending.erase(pkgname);
+      d->triggers_deferred.erase(pkgname);
+   }
+   else if (prefix == "status" && action == "triggers-pending")
+      d->triggers_pending.insert(pkgname);
+   else if (prefix == "status" && action == "installed")
+   {
+      d->triggers_pending.erase(pkgname);
+      d->triggers_deferred.erase(pkgname);
+   }
+
    // At this point we have a pkgname, but it might not be arch-qualified !
    if (pkgname.find(":") == std::string::npos)
    {
@@ -778,12 +825,9 @@ void pkgDPkgPM::ProcessDpkgStatusLine(char *line)
       }
    }
 
-   std::string arch = "";
-   if (pkgname.find(":") != string::npos)
-      arch = StringSplit(pkgname, ":")[1];
    std::string i18n_pkgname = pkgname;
-   if (arch.size() != 0)
-      strprintf(i18n_pkgname, "%s (%s)", StringSplit(pkgname, ":")[0].c_str(), arch.c_str());
+   if (auto const colon = pkgname.find(':'); colon != string::npos && colon + 1 != pkgname.length())
+      strprintf(i18n_pkgname, "%.*s (%s)", static_cast<int>(colon), pkgname.c_str(), pkgname.c_str() + colon + 1);
 
    // 'processing' from dpkg looks like
    // 'processing: action: pkg'
@@ -813,9 +857,10 @@ void pkgDPkgPM::ProcessDpkgStatusLine(char *line)
    if (prefix == "status")
    {
       std::vector<struct DpkgState> &states = PackageOps[pkgname];
-      if(PackageOpsDone[pkgname] < states.size())
+      unsigned int &opsDone = PackageOpsDone[pkgname];
+      if(opsDone < states.size())
       {
-	 char const * next_action = states[PackageOpsDone[pkgname]].state;
+	 char const * next_action = states[opsDone].state;
 	 if (next_action)
 	 {
 	    /*
@@ -834,16 +879,16 @@ void pkgDPkgPM::ProcessDpkgStatusLine(char *line)
 	    if (Debug == true)
 	       std::clog << "(parsed from dpkg) pkg: " << pkgname
 		  << " action: " << action << " (expected: '" << next_action << "' "
-		  << PackageOpsDone[pkgname] << " of " << states.size() << ")" << endl;
+		  << opsDone << " of " << states.size() << ")" << endl;
 
 	    // check if the package moved to the next dpkg state
 	    if(action == next_action)
 	    {
 	       // only read the translation if there is actually a next action
-	       char const * const translation = _(states[PackageOpsDone[pkgname]].str);
+	       char const * const translation = _(states[opsDone].str);
 
 	       // we moved from one dpkg state to a new one, report that
-	       ++PackageOpsDone[pkgname];
+	       ++opsDone;
 	       ++PackagesDone;
 
 	       std::string msg;
@@ -857,7 +902,7 @@ void pkgDPkgPM::ProcessDpkgStatusLine(char *line)
 	 if (Debug == true)
 	    std::clog << "(parsed from dpkg) pkg: " << pkgname
 	       << " action: " << action << " (prefix 2 to "
-	       << PackageOpsDone[pkgname] << " of " << states.size() << ")" << endl;
+	       << opsDone << " of " << states.size() << ")" << endl;
 
 	 states.insert(states.begin(), {"installed", N_("Installed %s")});
 	 states.insert(states.begin(), {"half-configured", N_("Configuring %s")});
@@ -986,7 +1031,7 @@ void pkgDPkgPM::DoDpkgStatusFd(int statusfd)
    }
 
    // otherwise move the unprocessed tail to the start and update pos
-   memmove(d->dpkgbuf.data(), p, (p - d->dpkgbuf.data()));
+   memmove(d->dpkgbuf.data(), p, &d->dpkgbuf[d->dpkgbuf_pos] - p);
    d->dpkgbuf_pos = &d->dpkgbuf[d->dpkgbuf_pos] - p;
 }
 									/*}}}*/
@@ -1176,6 +1221,13 @@ void pkgDPkgPM::BuildPackagesProgressMap()
    }};
    static_assert(Item::Purge == 3, "Enum item has unexpected index for mapping array");
 
+   // Go is called again for each batch (e.g. on media swaps), which
+   // mustn't count the operations of the previous ones
+   PackageOps.clear();
+   PackageOpsDone.clear();
+   PackagesDone = 0;
+   PackagesTotal = 0;
+
    // init the PackageOps map, go over the list of packages that
    // that will be [installed|configured|removed|purged] and add
    // them to the PackageOps map (the dpkg states it goes through)
@@ -1396,6 +1448,100 @@ static void cleanUpTmpDir(char * const tmpdir)				/*{{{*/
    free(tmpdir);
 }
 									/*}}}*/
+static void cleanUpStagedArchives(char * const tmpdir)			/*{{{*/
+{
+   if (tmpdir == nullptr)
+      return;
+   DIR * const D = opendir(tmpdir);
+   if (D == nullptr)
+      _error->Errno("opendir", _("Unable to read %s"), tmpdir);
+   else
+   {
+      auto const dfd = dirfd(D);
+      for (struct dirent *Ent = readdir(D); Ent != nullptr; Ent = readdir(D))
+      {
+	 if (Ent->d_name[0] == '.')
+	    continue;
+	 if (unlikely(unlinkat(dfd, Ent->d_name, 0) != 0))
+	    break;
+      }
+      closedir(D);
+      rmdir(tmpdir);
+   }
+   free(tmpdir);
+}
+									/*}}}*/
+// StageDecompressedArchives - Decompress data members in parallel	/*{{{*/
+/* dpkg decompresses the data member of each archive while unpacking it,
+   one archive after the other. With DPkg::Decompress-Before-Unpack this
+   is done upfront in parallel for the archives of one dpkg call instead
+   and dpkg is given copies with an uncompressed data member. Nothing is
+   staged if the copies and the unpacked files (\b Needed bytes) would not
+   fit on the filesystem. Archives which can't be staged for whatever
+   reason are passed on to dpkg unchanged. */
+static char *StageDecompressedArchives(std::vector<std::string> &Archives, unsigned long long const Needed)
+{
+   if (Archives.size() < 2)
+      return nullptr;
+   std::string const archivedir = _config->FindDir("Dir::Cache::Archives");
+   struct statvfs Buf;
+   if (statvfs(archivedir.c_str(), &Buf) != 0 ||
+       static_cast<unsigned long long>(Buf.f_bavail) * Buf.f_frsize < Needed)
+      return nullptr;
+   std::string tmpdir = flCombine(archivedir, "apt-dpkg-unpack-XXXXXX");
+   char * const stagedir = strndup(tmpdir.data(), tmpdir.length());
+   if (mkdtemp(stagedir) == nullptr)
+   {
+      _error->WarningE("DPkg::Go", "mkdtemp of %s failed in preparation of decompressing archives", stagedir);
+      free(stagedir);
+      return nullptr;
+   }
+
+   // the compressors are cached on first use, do that before the threads need them
+   APT::Configuration::getCompressors();
+   std::vector<std::string> Staged(Archives.size());
+   std::atomic<size_t> Next{0};
+   auto const Worker = [&]() {
+      // errors are reported on the stack of this thread and dropped with it
+      for (size_t i; (i = Next++) < Archives.size();)
+      {
+	 std::string Target = flCombine(stagedir, std::string{flNotDir(Archives[i])});
+	 FileFd Fd;
+	 if (Fd.Open(Archives[i], FileFd::ReadOnly))
+	 {
+	    debDebFile Deb(Fd);
+	    if (not _error->PendingError() && Deb.WriteDecompressed(Target))
+	       Staged[i] = std::move(Target);
+	 }
+	 _error->Discard();
+      }
+   };
+   auto Threads = std::min<size_t>(Archives.size(), std::max(1u, std::thread::hardware_concurrency()));
+   std::vector<std::thread> Workers;
+   Workers.reserve(Threads);
+   for (size_t t = 0; t < Threads; ++t)
+   {
+      try
+      {
+	 Workers.emplace_back(Worker);
+      }
+      catch (std::system_error const &)
+      {
+	 break;
+      }
+   }
+   // without any thread the archives are staged one after the other here
+   if (Workers.empty())
+      Worker();
+   for (auto &&W : Workers)
+      W.join();
+
+   for (size_t i = 0; i < Archives.size(); ++i)
+      if (not Staged[i].empty())
+	 Archives[i] = std::move(Staged[i]);
+   return stagedir;
+}
+									/*}}}*/
 
 // DPkgPM::Go - Run the sequence					/*{{{*/
 // ---------------------------------------------------------------------
@@ -1547,6 +1693,10 @@ bool pkgDPkgPM::Go(APT::Progress::PackageManager *progress)
 
    pkgPackageManager::SigINTStop = false;
    d->progress = progress;
+   d->triggers_pending.clear();
+   d->triggers_deferred.clear();
+   d->trigger_runs = d->trigger_deferrals = 0;
+   d->debug_progress = _config->FindB("Debug::pkgDPkgProgressReporting", false);
 
    // try to figure out the max environment size
    int OSArgMax = sysconf(_SC_ARG_MAX);
@@ -1757,6 +1907,10 @@ bool pkgDPkgPM::Go(APT::Progress::PackageManager *progress)
    }
    bool const TriggersPending = _config->FindB("DPkg::TriggersPending", false);
 
+   bool const DecompressBeforeUnpack = noopDPkgInvocation == false &&
+      _config->FindB("DPkg::Decompress-Before-Unpack", false) &&
+      _config->FindDir("DPkg::Chroot-Directory", "/") == "/";
+
    d->stdin_is_dev_null = false;
 
    // create log
@@ -1805,8 +1959,9 @@ bool pkgDPkgPM::Go(APT::Progress::PackageManager *progress)
       Args.push_back(std::to_string(fd[1]));
       unsigned long const Op = I->Op;
 
-      if (NoTriggers == true && I->Op != Item::TriggersPending &&
-	  (I->Op != Item::ConfigurePending || std::next(I) != List.end()))
+      bool const DeferTriggers = NoTriggers == true && I->Op != Item::TriggersPending &&
+	  (I->Op != Item::ConfigurePending || std::next(I) != List.end());
+      if (DeferTriggers)
 	 Args.push_back("--no-triggers");
 
       switch (I->Op)
@@ -1853,13 +2008,40 @@ bool pkgDPkgPM::Go(APT::Progress::PackageManager *progress)
       }
 
       std::unique_ptr<char, decltype(&cleanUpTmpDir)> tmpdir_for_dpkg_recursive{nullptr, &cleanUpTmpDir};
+      // removed once this dpkg call is done
+      std::unique_ptr<char, decltype(&cleanUpStagedArchives)> staged_archives{nullptr, &cleanUpStagedArchives};
       std::string const dpkg_chroot_dir = _config->FindDir("DPkg::Chroot-Directory", "/");
 
       // Write in the file or package names
       if (I->Op == Item::Install)
       {
 	 auto const installsToDo = J - I;
-	 if (dpkg_recursive_install == true && dpkg_recursive_install_min < installsToDo)
+	 bool const recursive = dpkg_recursive_install == true && dpkg_recursive_install_min < installsToDo;
+
+	 // collect the archives of this call first, so that only these are staged
+	 std::vector<std::string> Archives;
+	 unsigned long long stageNeeded = 0;
+	 size_t const stagePrefix = DecompressBeforeUnpack ? flCombine(_config->FindDir("Dir::Cache::Archives"), "apt-dpkg-unpack-XXXXXX/").length() : 0;
+	 for (auto bytes = Args.bytes(); I != J && (recursive || bytes < MaxArgBytes); ++I)
+	 {
+	    if (I->File[0] != '/')
+	       return _error->Error("Internal Error, Pathname to install is not absolute '%s'",I->File.c_str());
+	    Archives.push_back(I->File);
+	    bytes += std::max(I->File.length(), stagePrefix + flNotDir(I->File).length());
+	    if (DecompressBeforeUnpack == false)
+	       continue;
+	    // the copy holds the unpacked data and the other members, and dpkg unpacks the data again
+	    struct stat Buf;
+	    if (stat(I->File.c_str(), &Buf) == 0)
+	       stageNeeded += Buf.st_size;
+	    auto const InstVer = I->Pkg.end() ? pkgCache::VerIterator{} : Cache[I->Pkg].InstVerIter(Cache);
+	    if (InstVer.end() == false)
+	       stageNeeded += 2 * InstVer->InstalledSize;
+	 }
+	 if (DecompressBeforeUnpack)
+	    staged_archives.reset(StageDecompressedArchives(Archives, stageNeeded));
+
+	 if (recursive)
 	 {
 	    {
 	       std::string basetmpdir = (dpkg_chroot_dir == "/") ? GetTempDir() : flCombine(dpkg_chroot_dir, "tmp");
@@ -1872,11 +2054,9 @@ bool pkgDPkgPM::Go(APT::Progress::PackageManager *progress)
 
 	    char p = 1;
 	    for (auto c = installsToDo - 1; (c = c/10) != 0; ++p);
-	    for (unsigned long n = 0; I != J; ++n, ++I)
+	    for (unsigned long n = 0; n != Archives.size(); ++n)
 	    {
-	       if (I->File[0] != '/')
-		  return _error->Error("Internal Error, Pathname to install is not absolute '%s'",I->File.c_str());
-	       std::string file{flNotDir(I->File)};
+	       std::string file{flNotDir(Archives[n])};
 	       if (flExtension(file) != "deb")
 		  file.append(".deb");
 	       std::string linkpath;
@@ -1884,14 +2064,14 @@ bool pkgDPkgPM::Go(APT::Progress::PackageManager *progress)
 		  strprintf(linkpath, "%s/%.*lu-%s", tmpdir_for_dpkg_recursive.get(), p, n, file.c_str());
 	       else
 		  strprintf(linkpath, "%s/%s", tmpdir_for_dpkg_recursive.get(), file.c_str());
-	       std::string linktarget = I->File;
+	       std::string linktarget = Archives[n];
 	       if (dpkg_chroot_dir != "/") {
 		  char * fakechroot = getenv("FAKECHROOT");
 		  if (fakechroot != nullptr && strcmp(fakechroot, "true") == 0) {
 		     // if apt is run with DPkg::Chroot-Directory under
 		     // fakechroot, absolulte symbolic links must be prefixed
 		     // with the chroot path to be valid inside fakechroot
-		     strprintf(linktarget, "%s/%s", dpkg_chroot_dir.c_str(), I->File.c_str());
+		     strprintf(linktarget, "%s/%s", dpkg_chroot_dir.c_str(), Archives[n].c_str());
 		  }
 	       }
 	       if (symlink(linktarget.c_str(), linkpath.c_str()) != 0)
@@ -1902,12 +2082,8 @@ bool pkgDPkgPM::Go(APT::Progress::PackageManager *progress)
 	 }
 	 else
 	 {
-	    for (;I != J && Args.bytes() < MaxArgBytes; ++I)
-	    {
-	       if (I->File[0] != '/')
-		  return _error->Error("Internal Error, Pathname to install is not absolute '%s'",I->File.c_str());
-	       Args.push_back(I->File.c_str());
-	    }
+	    for (auto &&File : Archives)
+	       Args.push_back(std::move(File));
 	 }
       }
       else if (I->Op == Item::RemovePending)
@@ -2131,6 +2307,12 @@ bool pkgDPkgPM::Go(APT::Progress::PackageManager *progress)
       signal(SIGINT,old_SIGINT);
       signal(SIGHUP,old_SIGHUP);
 
+      // a trigger left pending over several calls is only deferred once
+      if (DeferTriggers)
+	 for (auto const &Pkg : d->triggers_pending)
+	    if (d->triggers_deferred.insert(Pkg).second)
+	       ++d->trigger_deferrals;
+
       if (waitpid_failure == true)
       {
 	 strprintf(d->dpkg_error, "Sub-process %s couldn't be waited for.",Args.front());
@@ -2160,6 +2342,15 @@ bool pkgDPkgPM::Go(APT::Progress::PackageManager *progress)
    }
    // dpkg is done at this point
    StopPtyMagic();
+   if (d->trigger_runs != 0 || d->trigger_deferrals != 0)
+   {
+      // each deferral is a trigger run dpkg would have done at the end of an intermediate call
+      if (d->term_out != nullptr)
+	 fprintf(d->term_out, "Triggers processed: %lu, deferred: %lu\n", d->trigger_runs, d->trigger_deferrals);
+      if (_config->FindB("Debug::pkgDPkgPM::Triggers", false))
+	 std::clog << "Processed triggers " << d->trigger_runs << " times, avoided "
+		   << d->trigger_deferrals << " runs by deferring them" << std::endl;
+   }
    CloseLog();
 
    if (d->dpkg_error.empty() == false)
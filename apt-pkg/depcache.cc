@@ -20,6 +20,7 @@
 #include <apt-pkg/fileutl.h>
 #include <apt-pkg/macros.h>
 #include <apt-pkg/pkgcache.h>
+#include <apt-pkg/policy.h>
 #include <apt-pkg/prettyprinters.h>
 #include <apt-pkg/progress.h>
 #include <apt-pkg/strutl.h>
@@ -39,6 +40,8 @@
 #include <set>
 #include <sstream>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -111,6 +114,10 @@ struct pkgDepCache::Private
    std::unique_ptr<APT::CacheFilter::Matcher> IsAVersionedKernelPackage, IsProtectedKernelPackage;
    std::string machineID;
    unsigned long iUpgradeCount{0};
+   // the policy holds exactly the preferences, see pkgCacheFile::BuildPolicy
+   bool PolicyFromPreferences{false};
+   // auto-installed bits as recorded in extended_states and its journal
+   std::vector<bool> AutoOnDisk;
 };
 pkgDepCache::pkgDepCache(pkgCache *const pCache, Policy *const Plcy) : group_level(0), Cache(pCache), PkgState(0), DepState(0),
 								       iUsrSize(0), iDownloadSize(0), iInstCount(0), iDelCount(0), iKeepCount(0),
@@ -236,6 +243,21 @@ bool pkgDepCache::Init(OpProgress * const Prog)
    memset(PkgState,0,sizeof(*PkgState)*Head().PackageCount);
    memset(DepState,0,sizeof(*DepState)*Head().DependsCount);
 
+   /* If the cache, the policy and the extended states are unchanged since
+      the last run, the states computed back then are still valid */
+   std::string const SnapshotFile = _config->FindFile("Dir::Cache::depcache");
+   uint64_t SnapshotKey = 0;
+   if (SnapshotFile.empty() == false && d->PolicyFromPreferences)
+   {
+      SnapshotKey = StateSnapshotKey();
+      if (ReadStateSnapshot(SnapshotFile, SnapshotKey))
+      {
+	 if (Prog != 0)
+	    Prog->Done();
+	 return true;
+      }
+   }
+
    if (Prog != 0)
    {
       Prog->OverallProgress(0,2*Head().PackageCount,Head().PackageCount,
@@ -273,16 +295,202 @@ bool pkgDepCache::Init(OpProgress * const Prog)
 
    Update(Prog);
 
+   if (SnapshotKey != 0)
+      WriteStateSnapshot(SnapshotFile, SnapshotKey);
+
    if(Prog != 0)
       Prog->Done();
 
    return true;
 }
 									/*}}}*/
-bool pkgDepCache::readStateFile(OpProgress * const Prog)		/*{{{*/
+// DepCache::*StateSnapshot - Persist the initial states		/*{{{*/
+// ---------------------------------------------------------------------
+/* The snapshot stores the candidate versions, flags and dependency states
+   computed by Init together with the counters. It is only valid for the
+   exact cache, preferences and extended states it was created from and
+   the options influencing the candidates, so all of them are combined
+   into the key. It is only used if the policy was built from the
+   preferences files alone, as other pins can't be part of the key. */
+namespace
+{
+struct StateSnapshotHeader
+{
+   char Signature[8];
+   uint64_t Key;
+   uint32_t PackageCount;
+   uint32_t DependsCount;
+   int64_t UsrSize;
+   uint64_t DownloadSize;
+   uint64_t InstCount;
+   uint64_t DelCount;
+   uint64_t KeepCount;
+   uint64_t BrokenCount;
+   uint64_t PolicyBrokenCount;
+   uint64_t BadCount;
+   uint64_t UpgradeCount;
+};
+struct StateSnapshotPackage
+{
+   uint32_t CandidateVer;
+   uint16_t Flags;
+   signed char Status;
+   unsigned char DepState;
+};
+constexpr char StateSnapshotSignature[8] = {'A', 'P', 'T', 'D', 'E', 'P', '0', '1'};
+} // namespace
+static void AddFileStamp(std::string &Key, std::string const &File)
+{
+   struct stat Buf;
+   if (stat(File.c_str(), &Buf) != 0)
+      Key.append(File).append(" -\n");
+   else
+      strprintf(Key, "%s%s %lld.%09ld %lld.%09ld %lld\n", Key.c_str(), File.c_str(), (long long)Buf.st_mtim.tv_sec, Buf.st_mtim.tv_nsec,
+		(long long)Buf.st_ctim.tv_sec, Buf.st_ctim.tv_nsec, (long long)Buf.st_size);
+}
+void pkgDepCache::SetPolicyFromPreferences()
+{
+   d->PolicyFromPreferences = true;
+}
+uint64_t pkgDepCache::StateSnapshotKey()
+{
+   std::ostringstream Config;
+   Config << _config->Find("Dir") << '\n';
+   for (auto const Tree : {"APT::Architecture", "APT::Architectures", "APT::Default-Release",
+			   "APT::Get::Phase-Policy", "APT::Get::Always-Include-Phased-Updates",
+			   "APT::Get::Never-Include-Phased-Updates", "Update-Manager", "Dir::State", "Dir::Etc"})
+      _config->Dump(Config, Tree, "%F %V\n", true);
+   std::string Key = Config.str();
+   strprintf(Key, "%s%u\n%s\n", Key.c_str(), Cache->CacheHash(), d->machineID.c_str());
+   AddFileStamp(Key, _config->FindFile("Dir::State::extended_states"));
+   AddFileStamp(Key, _config->FindFile("Dir::State::extended_states-journal"));
+   AddFileStamp(Key, _config->FindFile("Dir::Etc::Preferences"));
+   std::string const Parts = _config->FindDir("Dir::Etc::PreferencesParts");
+   if (DirectoryExists(Parts))
+   {
+      _error->PushToStack();
+      for (auto const &File : GetListOfFilesInDir(Parts, "pref", true, true))
+	 AddFileStamp(Key, File);
+      _error->RevertToStack();
+   }
+   auto const Hash = std::hash<std::string>{}(Key);
+   return Hash == 0 ? 1 : Hash;
+}
+bool pkgDepCache::ReadStateSnapshot(std::string const &File, uint64_t const Key)
+{
+   if (RealFileExists(File) == false)
+      return false;
+   _error->PushToStack();
+   FileFd Snapshot(File, FileFd::ReadOnly, FileFd::None);
+   StateSnapshotHeader Header;
+   std::vector<StateSnapshotPackage> Pkgs(Head().PackageCount);
+   bool const Okay = Snapshot.IsOpen() &&
+		     Snapshot.Read(&Header, sizeof(Header)) &&
+		     memcmp(Header.Signature, StateSnapshotSignature, sizeof(Header.Signature)) == 0 &&
+		     Header.Key == Key &&
+		     Header.PackageCount == Head().PackageCount &&
+		     Header.DependsCount == Head().DependsCount &&
+		     Snapshot.Read(Pkgs.data(), Pkgs.size() * sizeof(Pkgs[0])) &&
+		     Snapshot.Read(DepState, Head().DependsCount);
+   _error->RevertToStack();
+   if (Okay == false)
+      return false;
+
+   for (PkgIterator I = PkgBegin(); I.end() != true; ++I)
+   {
+      StateCache &State = PkgState[I->ID];
+      auto const &Pkg = Pkgs[I->ID];
+      State.CandidateVer = Pkg.CandidateVer == 0 ? nullptr : Cache->VerP + map_pointer<Version>{Pkg.CandidateVer};
+      State.InstallVer = I.CurrentVer();
+      State.Mode = ModeKeep;
+      State.Update(I, *this);
+      State.Flags = Pkg.Flags;
+      State.Status = Pkg.Status;
+      State.DepState = Pkg.DepState;
+   }
+   // the extended states are part of the key, so the flags are what is on disk
+   if (_config->FindFile("Dir::State::extended_states-journal").empty() == false)
+   {
+      d->AutoOnDisk.assign(Head().PackageCount, false);
+      for (PkgIterator I = PkgBegin(); I.end() != true; ++I)
+	 d->AutoOnDisk[I->ID] = (PkgState[I->ID].Flags & Flag::Auto) != 0;
+   }
+   iUsrSize = Header.UsrSize;
+   iDownloadSize = Header.DownloadSize;
+   iInstCount = Header.InstCount;
+   iDelCount = Header.DelCount;
+   iKeepCount = Header.KeepCount;
+   iBrokenCount = Header.BrokenCount;
+   iPolicyBrokenCount = Header.PolicyBrokenCount;
+   iBadCount = Header.BadCount;
+   d->iUpgradeCount = Header.UpgradeCount;
+   return true;
+}
+bool pkgDepCache::WriteStateSnapshot(std::string const &File, uint64_t const Key)
+{
+   StateSnapshotHeader Header{};
+   memcpy(Header.Signature, StateSnapshotSignature, sizeof(Header.Signature));
+   Header.Key = Key;
+   Header.PackageCount = Head().PackageCount;
+   Header.DependsCount = Head().DependsCount;
+   Header.UsrSize = iUsrSize;
+   Header.DownloadSize = iDownloadSize;
+   Header.InstCount = iInstCount;
+   Header.DelCount = iDelCount;
+   Header.KeepCount = iKeepCount;
+   Header.BrokenCount = iBrokenCount;
+   Header.PolicyBrokenCount = iPolicyBrokenCount;
+   Header.BadCount = iBadCount;
+   Header.UpgradeCount = d->iUpgradeCount;
+
+   std::vector<StateSnapshotPackage> Pkgs(Head().PackageCount);
+   for (PkgIterator I = PkgBegin(); I.end() != true; ++I)
+   {
+      StateCache const &State = PkgState[I->ID];
+      auto &Pkg = Pkgs[I->ID];
+      Pkg.CandidateVer = State.CandidateVer == nullptr ? 0 : State.CandidateVer - Cache->VerP;
+      Pkg.Flags = State.Flags;
+      Pkg.Status = State.Status;
+      Pkg.DepState = State.DepState;
+   }
+
+   // not being able to write a snapshot (e.g. as a user) is no error
+   _error->PushToStack();
+   FileFd Snapshot(File, FileFd::WriteAtomic, FileFd::None, 0644);
+   bool const Okay = Snapshot.IsOpen() &&
+		     Snapshot.Write(&Header, sizeof(Header)) &&
+		     Snapshot.Write(Pkgs.data(), Pkgs.size() * sizeof(Pkgs[0])) &&
+		     Snapshot.Write(DepState, Head().DependsCount) &&
+		     Snapshot.Close();
+   if (Okay == false)
+      Snapshot.OpFail();
+   _error->RevertToStack();
+   return Okay;
+}
+									/*}}}*/
+// DepCache::*StateFile - Read and write the extended states		/*{{{*/
+// ---------------------------------------------------------------------
+/* If Dir::State::extended_states-journal is set, changes to the
+   auto-installed bits are appended to this journal instead of rewriting
+   the whole extended_states file each time. The journal starts with the
+   size and modification time of the extended_states file it applies to,
+   so a journal left behind by an interrupted compaction is ignored. */
+static std::string StateFileStamp(std::string const &File)
+{
+   struct stat Buf;
+   if (stat(File.c_str(), &Buf) != 0)
+      return "";
+   std::string Stamp;
+   strprintf(Stamp, "%lld %lld.%09ld", (long long)Buf.st_size, (long long)Buf.st_mtim.tv_sec, Buf.st_mtim.tv_nsec);
+   return Stamp;
+}
+bool pkgDepCache::readStateFile(OpProgress * const Prog)
 {
    FileFd state_file;
    string const state = _config->FindFile("Dir::State::extended_states");
+   string const journal = _config->FindFile("Dir::State::extended_states-journal");
+   if (journal.empty() == false)
+      d->AutoOnDisk.assign(Head().PackageCount, false);
    if(RealFileExists(state)) {
       state_file.Open(state, FileFd::ReadOnly, FileFd::Extension);
       off_t const file_size = state_file.Size();
@@ -311,6 +519,8 @@ bool pkgDepCache::readStateFile(OpProgress * const Prog)		/*{{{*/
 	 if(reason > 0)
 	 {
 	    PkgState[pkg->ID].Flags |= Flag::Auto;
+	    if (journal.empty() == false)
+	       d->AutoOnDisk[pkg->ID] = true;
 	    if (unlikely(debug_autoremove))
 	       std::clog << "Auto-Installed : " << pkg.FullName() << std::endl;
 	    if (pkgarch == "any")
@@ -318,7 +528,11 @@ bool pkgDepCache::readStateFile(OpProgress * const Prog)		/*{{{*/
 	       pkgCache::GrpIterator G = pkg.Group();
 	       for (pkg = G.NextPkg(pkg); pkg.end() != true; pkg = G.NextPkg(pkg))
 		  if (pkg->VersionList != 0)
+		  {
 		     PkgState[pkg->ID].Flags |= Flag::Auto;
+		     if (journal.empty() == false)
+			d->AutoOnDisk[pkg->ID] = true;
+		  }
 	    }
 	 }
 	 amt += section.size();
@@ -331,6 +545,90 @@ bool pkgDepCache::readStateFile(OpProgress * const Prog)		/*{{{*/
 			       _("Reading state information"));
    }
 
+   // replay the changes recorded since extended_states was last written
+   FileFd journal_file;
+   if (journal.empty() == false && RealFileExists(journal) &&
+       journal_file.Open(journal, FileFd::ReadOnly, FileFd::None))
+   {
+      pkgTagFile tagfile(&journal_file);
+      pkgTagSection section;
+      if (tagfile.Step(section) == false || section.Find("Snapshot") != StateFileStamp(state))
+	 return true;
+      bool const debug_autoremove = _config->FindB("Debug::pkgAutoRemove",false);
+      while (tagfile.Step(section))
+      {
+	 pkgCache::PkgIterator const pkg = Cache->FindPkg(section.Find(pkgTagSection::Key::Package),
+							  section.Find(pkgTagSection::Key::Architecture));
+	 if (pkg.end() == true || pkg->VersionList == 0)
+	    continue;
+	 bool const Auto = section.FindI("Auto-Installed", 0) > 0;
+	 if (Auto)
+	    PkgState[pkg->ID].Flags |= Flag::Auto;
+	 else
+	    PkgState[pkg->ID].Flags &= ~Flag::Auto;
+	 d->AutoOnDisk[pkg->ID] = Auto;
+	 if (unlikely(debug_autoremove))
+	    std::clog << "Journaled Auto-Installed " << Auto << " : " << pkg.FullName() << std::endl;
+      }
+   }
+   return true;
+}
+// the auto-installed bit writeStateFile records for a package
+static bool StateFileAuto(pkgCache::PkgIterator const &Pkg, pkgDepCache::StateCache const &P, bool const InstalledOnly)
+{
+   if ((P.Flags & pkgCache::Flag::Auto) == 0)
+      return false;
+   // reset to default (=manual) not installed or now-removed ones if requested
+   return InstalledOnly == false || not (
+      (Pkg->CurrentVer == 0 && P.Mode != pkgDepCache::ModeInstall) ||
+      (Pkg->CurrentVer != 0 && P.Mode == pkgDepCache::ModeDelete));
+}
+bool pkgDepCache::writeStateJournal(std::string const &State, std::string const &Journal, bool const InstalledOnly)
+{
+   bool const debug_autoremove = _config->FindB("Debug::pkgAutoRemove",false);
+   std::string Changes;
+   for (pkgCache::PkgIterator pkg = Cache->PkgBegin(); pkg.end() == false; ++pkg)
+   {
+      if (pkg->VersionList == 0)
+	 continue;
+      bool const newAuto = StateFileAuto(pkg, PkgState[pkg->ID], InstalledOnly);
+      if (newAuto == d->AutoOnDisk[pkg->ID])
+	 continue;
+      if (debug_autoremove)
+	 std::clog << "Journal AutoInstall " << newAuto << " for " << APT::PrettyPkg(this, pkg) << std::endl;
+      Changes.append("Package: ").append(pkg.Name())
+	 .append("\nArchitecture: ").append(pkg.Arch())
+	 .append("\nAuto-Installed: ").append(newAuto ? "1" : "0").append("\n\n");
+   }
+   if (Changes.empty())
+      return true;
+
+   std::string const Stamp = StateFileStamp(State);
+   FileFd JournalFile;
+   if (RealFileExists(Journal))
+   {
+      // a journal for an older extended_states file is stale and replaced
+      FileFd Old(Journal, FileFd::ReadOnly, FileFd::None);
+      pkgTagFile tagfile(&Old);
+      pkgTagSection section;
+      if (tagfile.Step(section) && section.Find("Snapshot") == Stamp &&
+	  JournalFile.Open(Journal, FileFd::WriteOnly, FileFd::None, 0644) &&
+	  JournalFile.Seek(JournalFile.FileSize()) == false)
+	 return false;
+   }
+   if (JournalFile.IsOpen() == false)
+   {
+      if (JournalFile.Open(Journal, FileFd::WriteOnly | FileFd::Create | FileFd::Empty, FileFd::None, 0644) == false)
+	 return false;
+      Changes.insert(0, "Snapshot: " + Stamp + "\n\n");
+   }
+   if (JournalFile.Write(Changes.data(), Changes.length()) == false ||
+       JournalFile.Sync() == false || JournalFile.Close() == false)
+      return _error->Error(_("Failed to write temporary StateFile %s"), Journal.c_str());
+
+   for (pkgCache::PkgIterator pkg = Cache->PkgBegin(); pkg.end() == false; ++pkg)
+      if (pkg->VersionList != 0)
+	 d->AutoOnDisk[pkg->ID] = StateFileAuto(pkg, PkgState[pkg->ID], InstalledOnly);
    return true;
 }
 									/*}}}*/
@@ -346,6 +644,16 @@ bool pkgDepCache::writeStateFile(OpProgress * const /*prog*/, bool const Install
    if (CreateAPTDirectoryIfNeeded(_config->FindDir("Dir::State"), flNotFile(state)) == false)
       return false;
 
+   // append to the journal until it grows bigger than the file it amends
+   string const journal = _config->FindFile("Dir::State::extended_states-journal");
+   if (journal.empty() == false && d->AutoOnDisk.size() == Head().PackageCount && RealFileExists(state))
+   {
+      struct stat StateBuf, JournalBuf;
+      if (stat(state.c_str(), &StateBuf) == 0 &&
+	  (stat(journal.c_str(), &JournalBuf) != 0 || JournalBuf.st_size <= std::max<off_t>(StateBuf.st_size, 4096)))
+	 return writeStateJournal(state, journal, InstalledOnly);
+   }
+
    // if it does not exist, create a empty one
    if(!RealFileExists(state))
    {
@@ -441,6 +749,17 @@ bool pkgDepCache::writeStateFile(OpProgress * const /*prog*/, bool const Install
    if (OutFile.Close() == false)
       return false;
    chmod(state.c_str(), 0644);
+
+   // everything recorded in the journal is part of the file now
+   if (journal.empty() == false)
+   {
+      if (RealFileExists(journal) && RemoveFile("writeStateFile", journal) == false)
+	 return false;
+      d->AutoOnDisk.assign(Head().PackageCount, false);
+      for (pkgCache::PkgIterator pkg = Cache->PkgBegin(); pkg.end() == false; ++pkg)
+	 if (pkg->VersionList != 0)
+	    d->AutoOnDisk[pkg->ID] = StateFileAuto(pkg, PkgState[pkg->ID], InstalledOnly);
+   }
    return true;
 }
 									/*}}}*/
@@ -776,11 +1095,7 @@ void pkgDepCache::PerformDependencyPass(OpProgress * const Prog)
    iPolicyBrokenCount = 0;
    iBadCount = 0;
 
-   int Done = 0;
-   for (PkgIterator I = PkgBegin(); I.end() != true; ++I, ++Done)
-   {
-      if (Prog != 0 && Done%20 == 0)
-	 Prog->Progress(Done);
+   auto const BuildDepStates = [this](PkgIterator const &I) {
       for (VerIterator V = I.VersionList(); V.end() != true; ++V)
       {
 	 unsigned char Group = 0;
@@ -802,6 +1117,57 @@ void pkgDepCache::PerformDependencyPass(OpProgress * const Prog)
 	       State = ~State;
 	 }
       }
+   };
+
+   /* The states of the dependencies only depend on the (constant) install
+      and candidate versions and each dependency belongs to exactly one
+      package, so they can be computed in parallel. The package states and
+      counters are summed up serially afterwards as they involve the policy. */
+   unsigned int Threads = std::max(0, _config->FindI("APT::DepCache::Threads", 0));
+   if (Threads == 0)
+      Threads = std::min(std::thread::hardware_concurrency(), 8u);
+   unsigned int const MinDepends = std::max(0, _config->FindI("APT::DepCache::Threads-Min-Depends", 50000));
+   if (Threads > 1 && Head().DependsCount >= MinDepends)
+   {
+      std::vector<Package *> Pkgs;
+      Pkgs.reserve(Head().PackageCount);
+      for (PkgIterator I = PkgBegin(); I.end() != true; ++I)
+	 Pkgs.push_back(I);
+      if (Prog != 0)
+	 Prog->Progress(0);
+
+      std::vector<std::thread> Workers;
+      Workers.reserve(Threads);
+      auto const Chunk = (Pkgs.size() + Threads - 1) / Threads;
+      for (size_t Start = 0; Start < Pkgs.size(); Start += Chunk)
+      {
+	 auto const End = std::min(Start + Chunk, Pkgs.size());
+	 auto const BuildRange = [&, Start, End]() {
+	    for (size_t i = Start; i < End; ++i)
+	       BuildDepStates(PkgIterator(*Cache, Pkgs[i]));
+	 };
+	 // if no (more) threads can be created, do the work ourselves
+	 try
+	 {
+	    Workers.emplace_back(BuildRange);
+	 }
+	 catch (std::system_error const &)
+	 {
+	    BuildRange();
+	 }
+      }
+      for (auto &W : Workers)
+	 W.join();
+   }
+   else
+      for (PkgIterator I = PkgBegin(); I.end() != true; ++I)
+	 BuildDepStates(I);
+
+   int Done = 0;
+   for (PkgIterator I = PkgBegin(); I.end() != true; ++I, ++Done)
+   {
+      if (Prog != 0 && Done%20 == 0)
+	 Prog->Progress(Done);
 
       // Compute the package dependency state and size additions
       AddSizes(I);
@@ -823,20 +1189,41 @@ void pkgDepCache::Update(OpProgress * const Prog)
    It is mainly meant to scan reverse dependencies. */
 void pkgDepCache::Update(DepIterator D)
 {
-   // Update the reverse deps
+   std::vector<Version *> Dirty;
+   UpdateDependencyStates(D, Dirty);
+   UpdateDirtyVersions(Dirty);
+}
+/* The state of each dependency is recomputed and its parent version is
+   remembered, so that the states of the parents can be updated in one go
+   afterwards even if they have many dependencies on the changed package. */
+void pkgDepCache::UpdateDependencyStates(DepIterator D, std::vector<Version *> &Dirty)
+{
    for (;D.end() != true; ++D)
-   {      
+   {
       unsigned char &State = DepState[D->ID];
       State = DependencyState(D);
-    
+
       // Invert for Conflicts
       if (D.IsNegative() == true)
 	 State = ~State;
 
-      RemoveStates(D.ParentPkg());
-      BuildGroupOrs(D.ParentVer());
-      UpdateVerState(D.ParentPkg());
-      AddStates(D.ParentPkg());
+      Dirty.push_back(D.ParentVer());
+   }
+}
+void pkgDepCache::UpdateDirtyVersions(std::vector<Version *> &Dirty)
+{
+   std::sort(Dirty.begin(), Dirty.end(), [](Version const *const A, Version const *const B) {
+      return A->ParentPkg != B->ParentPkg ? A->ParentPkg < B->ParentPkg : A < B;
+   });
+   Dirty.erase(std::unique(Dirty.begin(), Dirty.end()), Dirty.end());
+   for (auto V = Dirty.begin(); V != Dirty.end();)
+   {
+      PkgIterator const Pkg = VerIterator(*Cache, *V).ParentPkg();
+      RemoveStates(Pkg);
+      for (; V != Dirty.end() && (*V)->ParentPkg == Pkg.MapPointer(); ++V)
+	 BuildGroupOrs(VerIterator(*Cache, *V));
+      UpdateVerState(Pkg);
+      AddStates(Pkg);
    }
 }
 									/*}}}*/
@@ -852,19 +1239,22 @@ void pkgDepCache::Update(PkgIterator const &Pkg)
    AddStates(Pkg);
    
    // Update the reverse deps
-   Update(Pkg.RevDependsList());
+   std::vector<Version *> Dirty;
+   UpdateDependencyStates(Pkg.RevDependsList(), Dirty);
 
    // Update the provides map for the current ver
    auto const CurVer = Pkg.CurrentVer();
    if (not CurVer.end())
       for (PrvIterator P = CurVer.ProvidesList(); not P.end(); ++P)
-	 Update(P.ParentPkg().RevDependsList());
+	 UpdateDependencyStates(P.ParentPkg().RevDependsList(), Dirty);
 
    // Update the provides map for the candidate ver
    auto const CandVer = PkgState[Pkg->ID].CandidateVerIter(*this);
    if (not CandVer.end() && CandVer != CurVer)
       for (PrvIterator P = CandVer.ProvidesList(); not P.end(); ++P)
-	 Update(P.ParentPkg().RevDependsList());
+	 UpdateDependencyStates(P.ParentPkg().RevDependsList(), Dirty);
+
+   UpdateDirtyVersions(Dirty);
 }
 									/*}}}*/
 // DepCache::IsModeChangeOk - check if it is ok to change the mode	/*{{{*/
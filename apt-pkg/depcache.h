@@ -48,6 +48,7 @@
 #include <string>
 #include <string_view>
 #include <utility>
+#include <vector>
 
 
 class OpProgress;
@@ -311,6 +312,7 @@ class APT_PUBLIC pkgDepCache : protected pkgCache::Namespace
 
    friend class ActionGroup;
    friend class Transaction;
+   friend class pkgCacheFile;
 
    public:
    int IncreaseActionGroupLevel();
@@ -552,6 +554,13 @@ class APT_PUBLIC pkgDepCache : protected pkgCache::Namespace
    APT_HIDDEN bool MarkInstall_DiscardInstall(PkgIterator const &Pkg);
 
    APT_HIDDEN void PerformDependencyPass(OpProgress * const Prog);
+   APT_HIDDEN void UpdateDependencyStates(DepIterator D, std::vector<Version *> &Dirty);
+   APT_HIDDEN void UpdateDirtyVersions(std::vector<Version *> &Dirty);
+   APT_HIDDEN void SetPolicyFromPreferences();
+   APT_HIDDEN uint64_t StateSnapshotKey();
+   APT_HIDDEN bool ReadStateSnapshot(std::string const &File, uint64_t const Key);
+   APT_HIDDEN bool WriteStateSnapshot(std::string const &File, uint64_t const Key);
+   APT_HIDDEN bool writeStateJournal(std::string const &State, std::string const &Journal, bool const InstalledOnly);
 };
 
 #endif
@@ -9,14 +9,17 @@
 
 #include <apt-pkg/algorithms.h>
 #include <apt-pkg/aptconfiguration.h>
+#include <apt-pkg/cachefile.h>
 #include <apt-pkg/cacheset.h>
 #include <apt-pkg/depcache.h>
 #include <apt-pkg/edsp.h>
 #include <apt-pkg/error.h>
 #include <apt-pkg/fileutl.h>
+#include <apt-pkg/mmap.h>
 #include <apt-pkg/packagemanager.h>
 #include <apt-pkg/pkgcache.h>
 #include <apt-pkg/pkgsystem.h>
+#include <apt-pkg/policy.h>
 #include <apt-pkg/prettyprinters.h>
 #include <apt-pkg/progress.h>
 #include <apt-pkg/solver3.h>
@@ -25,6 +28,7 @@
 
 #include <cctype>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <sys/stat.h>
@@ -33,8 +37,10 @@
 #include <algorithm>
 #include <array>
 #include <limits>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <apti18n.h>
 									/*}}}*/
@@ -358,6 +364,75 @@ bool EDSP::WriteLimitedScenario(pkgDepCache &Cache, FileFd &output,
    return WriteLimitedScenario(Cache, output, pkgset, Progress);
 }
 									/*}}}*/
+// EDSP::WriteBinaryScenario - to the given file descriptor		/*{{{*/
+/* The cache is only valid for the libapt-pkg which created it, so the
+   header starts with the version of the writer. The cache follows as-is,
+   then a flag byte for each package, the pin of each version and a flag
+   byte for each version, all indexed by the IDs in the cache. Unlike the
+   textual scenario nothing is left out, so the solver sees exactly what
+   it would see if it were running inside of APT. */
+namespace
+{
+struct BinaryScenarioHeader
+{
+   char Version[32];
+   uint64_t MapSize;
+   uint64_t PackageCount;
+   uint64_t VersionCount;
+};
+enum BinaryScenarioPkgFlags
+{
+   BinaryHold = (1 << 0),
+   BinaryAutomatic = (1 << 1),
+};
+enum BinaryScenarioVerFlags
+{
+   BinaryCandidate = (1 << 0),
+};
+} // namespace
+bool EDSP::WriteBinaryScenario(pkgDepCache &Cache, FileFd &output, OpProgress *Progress)
+{
+   if (Progress != NULL)
+      Progress->SubProgress(Cache.Head().PackageCount, _("Send scenario to solver"));
+   BinaryScenarioHeader Header{};
+   strncpy(Header.Version, PACKAGE_VERSION, sizeof(Header.Version) - 1);
+   Header.MapSize = Cache.GetCache().GetMap().Size();
+   Header.PackageCount = Cache.Head().PackageCount;
+   Header.VersionCount = Cache.Head().VersionCount;
+
+   std::vector<uint8_t> PkgFlags(Header.PackageCount);
+   std::vector<int16_t> Pins(Header.VersionCount);
+   std::vector<uint8_t> VerFlags(Header.VersionCount);
+   decltype(Cache.Head().PackageCount) p = 0;
+   for (auto Pkg = Cache.PkgBegin(); Pkg.end() == false; ++Pkg, ++p)
+   {
+      if (Pkg->SelectedState == pkgCache::State::Hold ||
+	  (Cache[Pkg].Keep() == true && Cache[Pkg].Protect() == true))
+	 PkgFlags[Pkg->ID] |= BinaryHold;
+      if ((Cache[Pkg].Flags & pkgCache::Flag::Auto) == pkgCache::Flag::Auto)
+	 PkgFlags[Pkg->ID] |= BinaryAutomatic;
+      auto const Cand = Cache.GetCandidateVersion(Pkg);
+      for (auto Ver = Pkg.VersionList(); Ver.end() == false; ++Ver)
+      {
+	 Pins[Ver->ID] = Cache.GetPolicy().GetPriority(Ver);
+	 if (Ver == Cand)
+	    VerFlags[Ver->ID] |= BinaryCandidate;
+      }
+      if (Progress != NULL && p % 100 == 0)
+	 Progress->Progress(p);
+   }
+
+   bool const Okay = output.Failed() == false &&
+		     output.Write(&Header, sizeof(Header)) &&
+		     output.Write(Cache.GetCache().GetMap().Data(), Header.MapSize) &&
+		     output.Write(PkgFlags.data(), PkgFlags.size()) &&
+		     output.Write(Pins.data(), Pins.size() * sizeof(Pins[0])) &&
+		     output.Write(VerFlags.data(), VerFlags.size());
+   if (Progress != NULL)
+      Progress->Done();
+   return Okay;
+}
+									/*}}}*/
 // EDSP::WriteRequest - to the given file descriptor			/*{{{*/
 bool EDSP::WriteRequest(pkgDepCache &Cache, FileFd &output,
 			unsigned int const flags,
@@ -409,6 +484,8 @@ bool EDSP::WriteRequest(pkgDepCache &Cache, FileFd &output,
       WriteOkay(Okay, output, "Forbid-Remove: yes\n");
    else if (flags & Request::FORBID_NEW_INSTALL)
       WriteOkay(Okay, output, "Forbid-Remove: no\n");
+   if (flags & Request::BINARY_SCENARIO)
+      WriteOkay(Okay, output, "Binary-Scenario: yes\n");
    auto const solver = _config->Find("APT::Solver", "internal");
    WriteOkay(Okay, output, "Solver: ", solver, "\n");
    if (_config->FindB("APT::Solver::Strict-Pinning", true) == false)
@@ -618,7 +695,8 @@ bool EDSP::ReadRequest(int const input, std::list<std::string> &install,
 	       ReadFlag(flags, line, "Upgrade-All:", Request::UPGRADE_ALL) ||
 	       ReadFlag(flags, line, "Forbid-New-Install:", Request::FORBID_NEW_INSTALL) ||
 	       ReadFlag(flags, line, "Forbid-Remove:", Request::FORBID_REMOVE) ||
-	       ReadFlag(flags, line, "Autoremove:", Request::AUTOREMOVE))
+	       ReadFlag(flags, line, "Autoremove:", Request::AUTOREMOVE) ||
+	       ReadFlag(flags, line, "Binary-Scenario:", Request::BINARY_SCENARIO))
 	 ;
       else if (LineStartsWithAndStrip(line, "Architecture:"))
 	 _config->Set("APT::Architecture", line);
@@ -638,6 +716,131 @@ bool EDSP::ReadRequest(int const input, std::list<std::string> &install,
    }
    return false;
 }									/*}}}*/
+// EDSP::ReadBinaryScenario - from the given file descriptor		/*{{{*/
+namespace
+{
+// the candidates and pins are those of APT, not computed again
+class edspBinaryPolicy final : public pkgPolicy
+{
+   std::vector<int16_t> Pins;
+   std::vector<uint8_t> VerFlags;
+
+   public:
+   using pkgPolicy::GetPriority;
+   pkgCache::VerIterator GetCandidateVer(pkgCache::PkgIterator const &Pkg) override
+   {
+      for (auto Ver = Pkg.VersionList(); Ver.end() == false; ++Ver)
+	 if ((VerFlags[Ver->ID] & BinaryCandidate) == BinaryCandidate)
+	    return Ver;
+      return pkgCache::VerIterator(*Cache);
+   }
+   signed short GetPriority(pkgCache::VerIterator const &Ver, bool ConsiderFiles) override
+   {
+      if (ConsiderFiles == false)
+	 return pkgPolicy::GetPriority(Ver, false);
+      return Pins[Ver->ID];
+   }
+   edspBinaryPolicy(pkgCache *Owner, std::vector<int16_t> &&Pins, std::vector<uint8_t> &&VerFlags)
+      : pkgPolicy(Owner), Pins(std::move(Pins)), VerFlags(std::move(VerFlags)) {}
+};
+// owns the cache read from the scenario, the depcache is built on open
+class edspBinaryCacheFile final : public pkgCacheFile
+{
+   public:
+   edspBinaryCacheFile(MMap *const Map, pkgCache *const Cache, pkgPolicy *const Policy)
+   {
+      this->Map = Map;
+      this->Cache = Cache;
+      this->Policy = Policy;
+   }
+};
+} // namespace
+std::unique_ptr<pkgCacheFile> EDSP::ReadBinaryScenario(int const input)
+{
+   FileFd In;
+   BinaryScenarioHeader Header;
+   if (In.OpenDescriptor(input, FileFd::ReadOnly, false) == false ||
+       In.Read(&Header, sizeof(Header)) == false)
+      return nullptr;
+   Header.Version[sizeof(Header.Version) - 1] = '\0';
+   if (strcmp(Header.Version, PACKAGE_VERSION) != 0)
+   {
+      _error->Error("The binary scenario was written by APT %s, but the solver uses %s", Header.Version, PACKAGE_VERSION);
+      return nullptr;
+   }
+
+   pkgCache::Header const DefHeader;
+   if (Header.MapSize < sizeof(DefHeader))
+   {
+      _error->Error(_("Empty package cache"));
+      return nullptr;
+   }
+   auto Map = std::make_unique<DynamicMMap>(0, Header.MapSize, 0);
+   Map->RawAllocate(Header.MapSize);
+   if (_error->PendingError() || In.Read(Map->Data(), Header.MapSize) == false)
+      return nullptr;
+
+   /* The cache is checked against the configured architectures, but the
+      request lists the barbarian ones as well, so use the ones it was
+      built for instead. */
+   auto const Head = static_cast<pkgCache::Header *>(Map->Data());
+   if (Head->Signature != DefHeader.Signature || uint32_t(Head->Architecture) >= Header.MapSize ||
+       uint32_t(Head->GetArchitectures()) >= Header.MapSize)
+   {
+      _error->Error(_("The package cache file is corrupted"));
+      return nullptr;
+   }
+   auto const Strings = static_cast<char *>(Map->Data());
+   auto const Archs = VectorizeString(Strings + Head->GetArchitectures(), ';');
+   _config->Set("APT::Architecture", Strings + Head->Architecture);
+   _config->Set("APT::Architectures", Archs.empty() ? "" : Archs[0]);
+   if (Archs.size() > 1)
+      _config->Set("APT::Architecture-Variants", Archs[1]);
+   else
+      _config->Clear("APT::Architecture-Variants");
+   APT::Configuration::getArchitectures(false);
+   APT::Configuration::getArchitectureVariants(false);
+
+   auto Cache = std::make_unique<pkgCache>(Map.get());
+   if (_error->PendingError() || Cache->Head().PackageCount != Header.PackageCount ||
+       Cache->Head().VersionCount != Header.VersionCount)
+   {
+      _error->Error(_("The package cache file is corrupted"));
+      return nullptr;
+   }
+
+   std::vector<uint8_t> PkgFlags(Header.PackageCount);
+   std::vector<int16_t> Pins(Header.VersionCount);
+   std::vector<uint8_t> VerFlags(Header.VersionCount);
+   if (In.Read(PkgFlags.data(), PkgFlags.size()) == false ||
+       In.Read(Pins.data(), Pins.size() * sizeof(Pins[0])) == false ||
+       In.Read(VerFlags.data(), VerFlags.size()) == false)
+      return nullptr;
+
+   // like the parser of the textual scenario, hold packages in the cache
+   // and pass the automatically installed ones via the extended states
+   std::string const States = _config->FindFile("Dir::State::extended_states");
+   RemoveFile("ReadBinaryScenario", States);
+   FileFd StatesFile(States, FileFd::WriteOnly | FileFd::Create | FileFd::Exclusive, 0600);
+   std::string Auto;
+   for (auto Pkg = Cache->PkgBegin(); Pkg.end() == false; ++Pkg)
+   {
+      if ((PkgFlags[Pkg->ID] & BinaryHold) == BinaryHold)
+	 Pkg->SelectedState = pkgCache::State::Hold;
+      if ((PkgFlags[Pkg->ID] & BinaryAutomatic) == BinaryAutomatic)
+	 strprintf(Auto, "%sPackage: %s\nArchitecture: %s\nAuto-Installed: 1\n\n", Auto.c_str(), Pkg.Name(), Pkg.Arch());
+   }
+   if (StatesFile.Write(Auto.data(), Auto.length()) == false || StatesFile.Close() == false)
+      return nullptr;
+
+   auto Policy = std::make_unique<edspBinaryPolicy>(Cache.get(), std::move(Pins), std::move(VerFlags));
+   if (_error->PendingError())
+      return nullptr;
+   auto Policy_ = Policy.release();
+   auto Cache_ = Cache.release();
+   return std::make_unique<edspBinaryCacheFile>(Map.release(), Cache_, Policy_);
+}
+									/*}}}*/
 // EDSP::ApplyRequest - first stanza from the given file descriptor	/*{{{*/
 bool EDSP::ApplyRequest(std::list<std::string> const &install,
 			 std::list<std::string> const &remove,
@@ -832,13 +1035,23 @@ bool EDSP::ResolveExternal(const char* const solver, pkgDepCache &Cache,
 	if (output.OpenDescriptor(solver_in, FileFd::WriteOnly | FileFd::BufferedWrite, true) == false)
 		return _error->Errno("ResolveExternal", "Opening solver %s stdin on fd %d for writing failed", solver, solver_in);
 
+	// the binary scenario is only understood by solvers built with this libapt-pkg
+	// and a dump of it would be useless for reporting bugs against the solver
+	bool const Binary = _config->FindB(std::string("APT::Solver::") + solver + "::Binary-Scenario",
+					   _config->FindB("APT::Solver::Binary-Scenario", false)) &&
+			    _config->FindFile("Dir::Log::Solver").empty();
+	unsigned int const RequestFlags = Binary ? (flags | Request::BINARY_SCENARIO) : flags;
+
 	bool Okay = output.Failed() == false;
 	if (Okay && Progress != NULL)
 		Progress->OverallProgress(0, 100, 5, _("Execute external solver"));
-	Okay &= EDSP::WriteRequest(Cache, output, flags, Progress);
+	Okay &= EDSP::WriteRequest(Cache, output, RequestFlags, Progress);
 	if (Okay && Progress != NULL)
 		Progress->OverallProgress(5, 100, 20, _("Execute external solver"));
-	Okay &= EDSP::WriteScenario(Cache, output, Progress);
+	if (Binary)
+		Okay &= EDSP::WriteBinaryScenario(Cache, output, Progress);
+	else
+		Okay &= EDSP::WriteScenario(Cache, output, Progress);
 	output.Close();
 
 	if (Okay && Progress != NULL)
@@ -16,10 +16,12 @@
 #include <cstdio>
 
 #include <list>
+#include <memory>
 #include <string>
 #include <vector>
 
 
+class pkgCacheFile;
 class pkgDepCache;
 class OpProgress;
 
@@ -33,6 +35,7 @@ namespace EDSP								/*{{{*/
 	      UPGRADE_ALL = (1 << 1), /*!< upgrade all installed packages, like 'apt-get full-upgrade' without forbid flags */
 	      FORBID_NEW_INSTALL = (1 << 2), /*!< forbid the resolver to install new packages */
 	      FORBID_REMOVE = (1 << 3), /*!< forbid the resolver to remove packages */
+	      BINARY_SCENARIO = (1 << 4), /*!< the scenario follows in the form written by #EDSP::WriteBinaryScenario */
 	   };
 	}
 	/** \brief creates the EDSP request stanza
@@ -107,6 +110,25 @@ namespace EDSP								/*{{{*/
 	APT_PUBLIC bool WriteLimitedScenario(pkgDepCache &Cache, FileFd &output,
 					     OpProgress *Progress = NULL);
 
+	/** \brief sends the package universe in binary form
+	 *
+	 *  Instead of rendering each version as a stanza, the package cache
+	 *  of APT is sent as-is followed by the states the depcache adds to
+	 *  it: the pins and the candidates of the versions as well as the
+	 *  holds and the automatically installed flags of the packages.
+	 *  The solver has to use the same version of libapt-pkg to read it
+	 *  with #ReadBinaryScenario, so it is only sent to solvers which
+	 *  asked for it via APT::Solver::NAME::Binary-Scenario and the
+	 *  request has to have the flag #Request::BINARY_SCENARIO set.
+	 *
+	 *  \param Cache is the known package universe
+	 *  \param output is written to this "file"
+	 *  \param Progress is an instance to report progress to
+	 *
+	 *  \return true if universe was composed successfully, otherwise false
+	 */
+	APT_PUBLIC bool WriteBinaryScenario(pkgDepCache &Cache, FileFd &output, OpProgress *Progress = NULL);
+
 	/** \brief waits and acts on the information returned from the solver
 	 *
 	 *  This method takes care of interpreting whatever the solver sends
@@ -142,6 +164,21 @@ namespace EDSP								/*{{{*/
 	APT_PUBLIC bool ReadRequest(int const input, std::list<std::string> &install,
 			std::list<std::string> &remove, unsigned int &flags);
 
+	/** \brief reads the binary scenario following the request
+	 *
+	 *  If #ReadRequest reported the flag #Request::BINARY_SCENARIO, the
+	 *  scenario was written by #WriteBinaryScenario and is read with this
+	 *  method instead of parsing it. The package cache is used as-is, the
+	 *  returned cache file builds the depcache on top of it with the
+	 *  pins, candidates, holds and automatically installed flags of APT
+	 *  once it is opened.
+	 *
+	 *  \param input file descriptor with the edsp input for the solver
+	 *
+	 *  \return the cache file or nullptr if the scenario couldn't be read
+	 */
+	APT_PUBLIC std::unique_ptr<pkgCacheFile> ReadBinaryScenario(int const input);
+
 	/** \brief takes the request lists and applies it on the cache
 	 *
 	 *  The lists as created by #ReadRequest will be used to find the
@@ -17,14 +17,19 @@
 #include <apt-pkg/pkgsystem.h>
 #include <apt-pkg/strutl.h>
 
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <sys/stat.h>
+
 #include <apti18n.h>
 									/*}}}*/
 
@@ -104,7 +109,62 @@ static bool pkgInitArchTupleMap()
 }
 									/*}}}*/
 
-    
+// ConfigSnapshotKey - Identify the input of the configuration files	/*{{{*/
+// ---------------------------------------------------------------------
+/* The configuration read so far decides where the files are, and the
+   directory and each file in it are identified by their stat data.
+   Files not readable by everyone might contain secrets which must not
+   end up in the world-readable snapshot. */
+static void AddFileStamp(std::string &Key, std::string const &File, bool &WorldReadable)
+{
+   Key.append(File);
+   struct stat Buf;
+   if (stat(File.c_str(), &Buf) != 0)
+   {
+      Key.append(" -\n");
+      return;
+   }
+   if ((Buf.st_mode & S_IROTH) == 0)
+      WorldReadable = false;
+   char Stamp[200];
+   snprintf(Stamp, sizeof(Stamp), " %lld.%09ld %lld.%09ld %lld %llu\n", (long long)Buf.st_mtim.tv_sec, Buf.st_mtim.tv_nsec,
+	    (long long)Buf.st_ctim.tv_sec, Buf.st_ctim.tv_nsec, (long long)Buf.st_size, (unsigned long long)Buf.st_ino);
+   Key.append(Stamp);
+}
+static uint64_t ConfigSnapshotKey(Configuration &Cnf, std::string const &Parts, std::string const &Main, bool &WorldReadable)
+{
+   // walk the tree directly, Dump() with its stream is the most expensive part of this
+   std::string Key;
+   for (Configuration::Item const *Top = Cnf.Tree(0); Top != nullptr;)
+   {
+      Key.append(Top->Tag).append(1, '\0').append(Top->Value).append(1, Top->Child != nullptr ? '{' : ';');
+      if (Top->Child != nullptr)
+      {
+	 Top = Top->Child;
+	 continue;
+      }
+      while (Top != nullptr && Top->Next == nullptr)
+      {
+	 Top = Top->Parent;
+	 Key.append(1, '}');
+      }
+      if (Top != nullptr)
+	 Top = Top->Next;
+   }
+   Key.append(PACKAGE_VERSION).append("\n");
+   AddFileStamp(Key, Parts, WorldReadable);
+   if (DirectoryExists(Parts))
+   {
+      _error->PushToStack();
+      for (auto const &File : GetListOfFilesInDir(Parts, "conf", true, true))
+	 AddFileStamp(Key, File, WorldReadable);
+      _error->RevertToStack();
+   }
+   AddFileStamp(Key, Main, WorldReadable);
+   auto const Hash = std::hash<std::string>{}(Key);
+   return Hash == 0 ? 1 : Hash;
+}
+									/*}}}*/
 // pkgInitConfig - Initialize the configuration class			/*{{{*/
 // ---------------------------------------------------------------------
 /* Directories are specified in such a way that the FindDir function will
@@ -178,6 +238,10 @@ bool pkgInitConfig(Configuration &Cnf)
    // The default user we drop to in the methods
    Cnf.CndSet("APT::Sandbox::User", "_apt");
 
+   // The solvers we ship are built against this library, so they can read our cache as-is
+   Cnf.CndSet("APT::Solver::apt::Binary-Scenario", true);
+   Cnf.CndSet("APT::Solver::solver3::Binary-Scenario", true);
+
    Cnf.CndSet("Acquire::IndexTargets::deb::Packages::MetaKey", "$(COMPONENT)/binary-$(ARCHITECTURE)/Packages");
    Cnf.CndSet("Acquire::IndexTargets::deb::Packages::flatMetaKey", "Packages");
    Cnf.CndSet("Acquire::IndexTargets::deb::Packages::ShortDescription", "Packages");
@@ -224,17 +288,34 @@ bool pkgInitConfig(Configuration &Cnf)
 	 _error->WarningE("RealFileExists",_("Unable to read %s"),Cfg);
    }
 
-   // Read the configuration parts dir
    std::string const Parts = Cnf.FindDir("Dir::Etc::parts", "/dev/null");
-   if (DirectoryExists(Parts) == true)
-      ReadConfigDir(Cnf, Parts);
-   else if (APT::String::Endswith(Parts, "/dev/null") == false)
-      _error->WarningE("DirectoryExists",_("Unable to read %s"),Parts.c_str());
-
-   // Read the main config file
    std::string const FName = Cnf.FindFile("Dir::Etc::main", "/dev/null");
-   if (RealFileExists(FName) == true)
-      ReadConfigFile(Cnf, FName);
+
+   // Parsing the files can be skipped if they are unchanged since the snapshot,
+   // which has to be enabled before them, e.g. in the file named by APT_CONFIG
+   std::string const Snapshot = Cnf.FindFile("Dir::Cache::config");
+   bool WorldReadable = true;
+   uint64_t const SnapshotKey = Snapshot.empty() ? 0 : ConfigSnapshotKey(Cnf, Parts, FName, WorldReadable);
+   if (SnapshotKey == 0 || Cnf.ReadSnapshot(Snapshot, SnapshotKey) == false)
+   {
+      auto const Directives = ConfigFileDirectivesRead();
+
+      // Read the configuration parts dir
+      if (DirectoryExists(Parts) == true)
+	 ReadConfigDir(Cnf, Parts);
+      else if (APT::String::Endswith(Parts, "/dev/null") == false)
+	 _error->WarningE("DirectoryExists",_("Unable to read %s"),Parts.c_str());
+
+      // Read the main config file
+      if (RealFileExists(FName) == true)
+	 ReadConfigFile(Cnf, FName);
+
+      // messages would be lost and the key doesn't cover included files
+      if (SnapshotKey != 0 && WorldReadable && _error->empty(GlobalError::DEBUG) &&
+	  Directives == ConfigFileDirectivesRead() &&
+	  Cnf.FindFile("Dir::Cache::config") == Snapshot)
+	 Cnf.WriteSnapshot(Snapshot, SnapshotKey);
+   }
 
    if (Cnf.FindB("Debug::pkgInitConfig",false) == true)
       Cnf.Dump();
@@ -15,7 +15,9 @@
 #include <apt-pkg/pkgcache.h>
 #include <apt-pkg/pkgrecords.h>
 
+#include <algorithm>
 #include <cstddef>
+#include <functional>
 #include <vector>
 
 #include <apti18n.h>
@@ -67,6 +69,39 @@ pkgRecords::Parser &pkgRecords::Lookup(pkgCache::DescFileIterator const &Desc)
    return *Files[Desc.File()->ID];
 }
 									/*}}}*/
+// Records::ForEach - Visit many records in the order of the files	/*{{{*/
+// ---------------------------------------------------------------------
+/* */
+template <typename Iterator>
+static bool ForEachInFileOrder(std::vector<Iterator> Sorted,
+			       std::function<bool(Iterator const &)> const &Callback)
+{
+   std::sort(Sorted.begin(), Sorted.end(), [](Iterator const &A, Iterator const &B) {
+      auto const FileA = A->File, FileB = B->File;
+      if (FileA != FileB)
+	 return FileA < FileB;
+      return A->Offset < B->Offset;
+   });
+   for (auto const &I : Sorted)
+      if (Callback(I) == false)
+	 return false;
+   return true;
+}
+bool pkgRecords::ForEach(std::vector<pkgCache::VerFileIterator> const &VerFiles,
+			 std::function<bool(pkgCache::VerFileIterator const &, Parser &)> const &Callback)
+{
+   return ForEachInFileOrder<pkgCache::VerFileIterator>(VerFiles, [&](pkgCache::VerFileIterator const &Vf) {
+      return Callback(Vf, Lookup(Vf));
+   });
+}
+bool pkgRecords::ForEach(std::vector<pkgCache::DescFileIterator> const &DescFiles,
+			 std::function<bool(pkgCache::DescFileIterator const &, Parser &)> const &Callback)
+{
+   return ForEachInFileOrder<pkgCache::DescFileIterator>(DescFiles, [&](pkgCache::DescFileIterator const &Df) {
+      return Callback(Df, Lookup(Df));
+   });
+}
+									/*}}}*/
 
 pkgRecords::Parser::Parser() : d(NULL) {}
 pkgRecords::Parser::~Parser() {}
@@ -20,6 +20,7 @@
 #include <apt-pkg/macros.h>
 #include <apt-pkg/pkgcache.h>
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -41,6 +42,22 @@ class APT_PUBLIC pkgRecords							/*{{{*/
    Parser &Lookup(pkgCache::VerFileIterator const &Ver);
    Parser &Lookup(pkgCache::DescFileIterator const &Desc);
 
+   /** \brief visit the records of many versions in file order
+    *
+    * The records are grouped by package file and sorted by their offset in
+    * it, so that each file is read front to back once instead of jumping
+    * around in it, which for compressed files means decompressing them
+    * from the start again and again.
+    *
+    * \param Callback is called with each record and the parser positioned
+    *   on it. Returning \b false stops the iteration.
+    * \return \b false if the callback stopped the iteration
+    */
+   bool ForEach(std::vector<pkgCache::VerFileIterator> const &VerFiles,
+		std::function<bool(pkgCache::VerFileIterator const &, Parser &)> const &Callback);
+   bool ForEach(std::vector<pkgCache::DescFileIterator> const &DescFiles,
+		std::function<bool(pkgCache::DescFileIterator const &, Parser &)> const &Callback);
+
    // Construct destruct
    explicit pkgRecords(pkgCache &Cache);
    virtual ~pkgRecords();
@@ -27,14 +27,18 @@
 #include <apt-pkg/version.h>
 #include <apt-pkg/versionmatch.h>
 
+#include <algorithm>
 #include <cctype>
 #include <cstddef>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <sstream>
 #include <string>
 #include <vector>
+#include <fnmatch.h>
+#include <regex.h>
 
 #include <apti18n.h>
    /*}}}*/
@@ -43,9 +47,27 @@ using namespace std;
 
 constexpr short NEVER_PIN = std::numeric_limits<short>::min();
 
+#ifndef FNM_CASEFOLD
+#define FNM_CASEFOLD 0
+#endif
+
 struct pkgPolicy::Private
 {
    std::string machineID;
+
+   // wildcard pins are collected and expanded together in one pass over
+   // all groups rather than one pass for each pin
+   struct WildcardPin : Pin
+   {
+      std::string Name;
+      std::string Arch;
+      bool IsSourcePin;
+   };
+   std::vector<WildcardPin> PendingWildcards;
+
+   bool PinGroup(pkgPolicy &Policy, pkgCache::GrpIterator const &Grp, std::string const &Arch, bool IsSourcePin, Pin const &P);
+   void AddUnmatched(pkgPolicy &Policy, std::string Name, std::string const &Arch, Pin const &P);
+   void ExpandWildcardPins(pkgPolicy &Policy);
 };
 
 // Policy::Init - Startup and bind to a cache				/*{{{*/
@@ -96,6 +118,8 @@ pkgPolicy::pkgPolicy(pkgCache *Owner) : VerPins(nullptr),
 /* */
 bool pkgPolicy::InitDefaults()
 {
+   d->ExpandWildcardPins(*this);
+
    // Initialize the priorities based on the status of the package file
    for (pkgCache::PkgFileIterator I = Cache->FileBegin(); I != Cache->FileEnd(); ++I)
    {
@@ -146,6 +170,7 @@ pkgCache::VerIterator pkgPolicy::GetCandidateVer(pkgCache::PkgIterator const &Pk
    pkgCache::VerIterator cur = Pkg.CurrentVer();
    int candPriority = -1;
    pkgVersioningSystem *vs = Cache->VS;
+   d->ExpandWildcardPins(*this);
 
    for (pkgCache::VerIterator ver = Pkg.VersionList(); ver.end() == false; ++ver) {
       int priority = GetPriority(ver, true);
@@ -174,12 +199,14 @@ pkgCache::VerIterator pkgPolicy::GetCandidateVer(pkgCache::PkgIterator const &Pk
 void pkgPolicy::CreatePin(pkgVersionMatch::MatchType Type,string Name,
 			  string Data,signed short Priority)
 {
+   Pin P;
+   P.Type = Type;
+   P.Priority = Priority;
+   P.Data = Data;
+
    if (Name.empty() == true)
    {
-      Pin *P = &*Defaults.insert(Defaults.end(),Pin());
-      P->Type = Type;
-      P->Priority = Priority;
-      P->Data = Data;
+      Defaults.push_back(P);
       return;
    }
 
@@ -199,88 +226,182 @@ void pkgPolicy::CreatePin(pkgVersionMatch::MatchType Type,string Name,
    // TODO: Maybe we should always prefer specific pins over non-specific ones.
    if ((Name[0] == '/' && Name[Name.length() - 1] == '/') || Name.find_first_of("*[?") != string::npos)
    {
-      pkgVersionMatch match(Data, Type);
-      for (pkgCache::GrpIterator G = Cache->GrpBegin(); G.end() != true; ++G)
-	 if (Name != G.Name() && match.ExpressionMatches(Name, G.Name()))
-	 {
-	    auto NameToPinFor = IsSourcePin ? string("src:").append(G.Name()) : string(G.Name());
-	    if (Arch.empty() == false)
-	       CreatePin(Type, NameToPinFor.append(":").append(Arch), Data, Priority);
-	    else
-	       CreatePin(Type, NameToPinFor, Data, Priority);
-	 }
+      Private::WildcardPin W;
+      static_cast<Pin &>(W) = P;
+      W.Name = Name;
+      W.Arch = Arch;
+      W.IsSourcePin = IsSourcePin;
+      d->PendingWildcards.push_back(std::move(W));
       return;
    }
 
+   // earlier wildcard pins take precedence over this one
+   d->ExpandWildcardPins(*this);
+
    // find the package (group) this pin applies to
    pkgCache::GrpIterator Grp = Cache->FindGrp(Name);
+   if (Grp.end() || d->PinGroup(*this, Grp, Arch, IsSourcePin, P) == false)
+      d->AddUnmatched(*this, Name, Arch, P);
+}
+									/*}}}*/
+// Policy::Private::PinGroup - Pin the matching versions of a group	/*{{{*/
+// ---------------------------------------------------------------------
+/* Returns true if at least one version was pinned */
+bool pkgPolicy::Private::PinGroup(pkgPolicy &Policy, pkgCache::GrpIterator const &Grp,
+				  std::string const &Arch, bool IsSourcePin, Pin const &P)
+{
    bool matched = false;
-   if (Grp.end() == false)
-   {
-      std::string MatchingArch;
-      if (Arch.empty() == true)
-	 MatchingArch = Cache->NativeArch();
-      else
-	 MatchingArch = Arch;
-      APT::CacheFilter::PackageArchitectureMatchesSpecification pams(MatchingArch);
+   APT::CacheFilter::PackageArchitectureMatchesSpecification pams(Arch.empty() ? Policy.Cache->NativeArch() : Arch);
+   pkgVersionMatch Match(P.Data, P.Type);
+   auto const PinVersion = [&](pkgCache::VerIterator const &Ver) {
+      // Find matching version(s) and copy the pin into it
+      if (Match.VersionMatches(Ver) == false)
+	 return;
+      Pin *VP = &Policy.VerPins[Ver->ID];
+      if (VP->Type == pkgVersionMatch::None) {
+	 *VP = P;
+	 matched = true;
+      }
+   };
 
-      if (IsSourcePin) {
-	 for (pkgCache::VerIterator Ver = Grp.VersionsInSource(); not Ver.end(); Ver = Ver.NextInSource())
+   if (IsSourcePin) {
+      for (pkgCache::VerIterator Ver = Grp.VersionsInSource(); not Ver.end(); Ver = Ver.NextInSource())
+	 if (pams(Ver.ParentPkg().Arch()))
+	    PinVersion(Ver);
+   } else {
+      for (pkgCache::PkgIterator Pkg = Grp.PackageList(); Pkg.end() != true; Pkg = Grp.NextPkg(Pkg))
+      {
+	 if (pams(Pkg.Arch()) == false)
+	    continue;
+	 for (pkgCache::VerIterator Ver = Pkg.VersionList(); Ver.end() != true; ++Ver)
+	    PinVersion(Ver);
+      }
+   }
+   return matched;
+}
+									/*}}}*/
+void pkgPolicy::Private::AddUnmatched(pkgPolicy &Policy, std::string Name, /*{{{*/
+				      std::string const &Arch, Pin const &P)
+{
+   if (Arch.empty() == false)
+      Name.append(":").append(Arch);
+   PkgPin UP(Name);
+   static_cast<Pin &>(UP) = P;
+   Policy.Unmatched.push_back(std::move(UP));
+}
+									/*}}}*/
+// Policy::Private::ExpandWildcardPins - Apply the pending wildcard pins/*{{{*/
+// ---------------------------------------------------------------------
+/* Globs are sorted into a trie by their literal prefix, so each group
+   name is only tried against the globs whose prefix it starts with. All
+   regular expressions are combined into one to rule out most groups with
+   a single regexec. The matching groups are collected for each pin and
+   the pins are then applied in the order they were created, so the
+   result is the same as expanding each pin on its own. */
+void pkgPolicy::Private::ExpandWildcardPins(pkgPolicy &Policy)
+{
+   if (PendingWildcards.empty())
+      return;
+   auto const Pins = std::move(PendingWildcards);
+   PendingWildcards.clear();
+
+   struct TrieNode
+   {
+      std::vector<std::pair<char, size_t>> Children;
+      std::vector<size_t> Pins;
+   };
+   std::vector<TrieNode> Trie(1);
+   std::vector<std::pair<size_t, std::unique_ptr<regex_t>>> Regexes;
+   std::string Combined;
+   bool CanCombine = true;
+   for (size_t I = 0; I < Pins.size(); ++I)
+   {
+      auto const &Name = Pins[I].Name;
+      if (Name.length() > 1 && Name[0] == '/' && Name[Name.length() - 1] == '/')
+      {
+	 auto const Expr = Name.substr(1, Name.length() - 2);
+	 auto Preg = std::make_unique<regex_t>();
+	 if (regcomp(Preg.get(), Expr.c_str(), REG_EXTENDED | REG_ICASE | REG_NOSUB) != 0)
 	 {
-	    if (pams(Ver.ParentPkg().Arch()) == false)
-	       continue;
-
-	    PkgPin P(Ver.ParentPkg().FullName());
-	    P.Type = Type;
-	    P.Priority = Priority;
-	    P.Data = Data;
-	    // Find matching version(s) and copy the pin into it
-	    pkgVersionMatch Match(P.Data,P.Type);
-	    if (Match.VersionMatches(Ver)) {
-	       Pin *VP = &VerPins[Ver->ID];
-	       if (VP->Type == pkgVersionMatch::None) {
-		  *VP = P;
-		   matched = true;
-	       }
-	    }
+	    _error->Warning("Invalid regular expression: %s", Expr.c_str());
+	    continue;
 	 }
-      } else {
-	 for (pkgCache::PkgIterator Pkg = Grp.PackageList(); Pkg.end() != true; Pkg = Grp.NextPkg(Pkg))
+	 Regexes.emplace_back(I, std::move(Preg));
+	 // back-references would refer to the wrong group in the combination
+	 for (size_t J = 0; J + 1 < Expr.length(); ++J)
+	    if (Expr[J] == '\\' && isdigit(Expr[J + 1]))
+	       CanCombine = false;
+	 if (Combined.empty() == false)
+	    Combined.append("|");
+	 Combined.append("(").append(Expr).append(")");
+	 continue;
+      }
+
+      size_t Node = 0;
+      for (auto const C : Name)
+      {
+	 if (C == '*' || C == '?' || C == '[' || C == '\\')
+	    break;
+	 char const Lower = tolower_ascii(C);
+	 auto Child = std::find_if(Trie[Node].Children.begin(), Trie[Node].Children.end(),
+				   [&](auto const &Ch) { return Ch.first == Lower; });
+	 if (Child != Trie[Node].Children.end())
 	 {
-	    if (pams(Pkg.Arch()) == false)
-	       continue;
-
-	    PkgPin P(Pkg.FullName());
-	    P.Type = Type;
-	    P.Priority = Priority;
-	    P.Data = Data;
-
-	    // Find matching version(s) and copy the pin into it
-	    pkgVersionMatch Match(P.Data,P.Type);
-	    for (pkgCache::VerIterator Ver = Pkg.VersionList(); Ver.end() != true; ++Ver)
-	    {
-	       if (Match.VersionMatches(Ver)) {
-		  Pin *VP = &VerPins[Ver->ID];
-		  if (VP->Type == pkgVersionMatch::None) {
-		     *VP = P;
-		      matched = true;
-		  }
-	       }
-	    }
+	    Node = Child->second;
+	    continue;
 	 }
+	 Trie[Node].Children.emplace_back(Lower, Trie.size());
+	 Node = Trie.size();
+	 Trie.emplace_back();
       }
+      Trie[Node].Pins.push_back(I);
    }
 
-   if (matched == false)
+   regex_t CombinedPreg;
+   bool const HaveCombined = CanCombine && Regexes.size() > 1 &&
+			     regcomp(&CombinedPreg, Combined.c_str(), REG_EXTENDED | REG_ICASE | REG_NOSUB) == 0;
+
+   // groups are collected per pin, so the pins can be applied one after
+   // the other in the order they were created like the specific ones
+   std::vector<std::vector<pkgCache::GrpIterator>> Groups(Pins.size());
+   for (pkgCache::GrpIterator G = Policy.Cache->GrpBegin(); G.end() != true; ++G)
    {
-      PkgPin *P = &*Unmatched.insert(Unmatched.end(),PkgPin(Name));
-      if (Arch.empty() == false)
-	 P->Pkg.append(":").append(Arch);
-      P->Type = Type;
-      P->Priority = Priority;
-      P->Data = Data;
-      return;
+      char const *const GrpName = G.Name();
+
+      size_t Node = 0;
+      for (char const *C = GrpName;; ++C)
+      {
+	 for (auto const P : Trie[Node].Pins)
+	    if (Pins[P].Name != GrpName && fnmatch(Pins[P].Name.c_str(), GrpName, FNM_CASEFOLD) == 0)
+	       Groups[P].push_back(G);
+	 if (*C == '\0')
+	    break;
+	 char const Lower = tolower_ascii(*C);
+	 auto Child = std::find_if(Trie[Node].Children.begin(), Trie[Node].Children.end(),
+				   [&](auto const &Ch) { return Ch.first == Lower; });
+	 if (Child == Trie[Node].Children.end())
+	    break;
+	 Node = Child->second;
+      }
+
+      if (Regexes.empty() == false && (HaveCombined == false || regexec(&CombinedPreg, GrpName, 0, nullptr, 0) == 0))
+	 for (auto const &R : Regexes)
+	    if (Pins[R.first].Name != GrpName && regexec(R.second.get(), GrpName, 0, nullptr, 0) == 0)
+	       Groups[R.first].push_back(G);
    }
+
+   for (size_t P = 0; P < Pins.size(); ++P)
+   {
+      auto const &W = Pins[P];
+      for (auto const &G : Groups[P])
+	 if (PinGroup(Policy, G, W.Arch, W.IsSourcePin, W) == false)
+	    AddUnmatched(Policy, G.Name(), W.Arch, W);
+   }
+
+   if (HaveCombined)
+      regfree(&CombinedPreg);
+   for (auto &R : Regexes)
+      regfree(R.second.get());
 }
 									/*}}}*/
 // Policy::GetPriority - Get the priority of the package pin		/*{{{*/
@@ -318,8 +439,9 @@ static inline bool ExcludePhased(std::string machineID, pkgCache::VerIterator co
 
    return dist(rand) > Ver.PhasedUpdatePercentage();
 }
-APT_PURE signed short pkgPolicy::GetPriority(pkgCache::VerIterator const &Ver, bool ConsiderFiles)
+signed short pkgPolicy::GetPriority(pkgCache::VerIterator const &Ver, bool ConsiderFiles)
 {
+   d->ExpandWildcardPins(*this);
    auto ceiling = std::numeric_limits<signed int>::max();
    if (ExcludePhased(d->machineID, Ver))
       ceiling = 1;
@@ -361,6 +483,7 @@ APT_PURE signed short pkgPolicy::GetPriority(pkgCache::PkgFileIterator const &Fi
 // ---------------------------------------------------------------------
 void pkgPolicy::SetPriority(pkgCache::VerIterator const &Ver, signed short Priority)
 {
+   d->ExpandWildcardPins(*this);
    Pin pin;
    pin.Data = "pkgPolicy::SetPriority";
    pin.Priority = Priority;
@@ -23,6 +23,7 @@
 #include <apt-pkg/version.h>
 
 #include <algorithm>
+#include <csignal>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
@@ -32,6 +33,7 @@
 #include <vector>
 #include <langinfo.h>
 #include <sys/statvfs.h>
+#include <unistd.h>
 
 #include <apt-private/acqprogress.h>
 #include <apt-private/private-cachefile.h>
@@ -182,6 +184,62 @@ static void RemoveDownloadNeedingItemsFromFetcher(pkgAcquire &Fetcher, bool &Tra
       I = Fetcher.ItemsBegin();
    }
 }
+// PostponeDownloadsBeyond - Drop downloads not needed for the next batch	/*{{{*/
+/* The archives are queued in installation order, so removing the items
+   after the first Limit bytes of archives makes the ordering stop at the
+   first of them, just as it does if a medium needs to be swapped. Archives
+   which are available already, e.g. from the previous prefetch, are kept
+   but count towards the size of the batch. */
+static bool PostponeDownloadsBeyond(pkgAcquire &Fetcher, unsigned long long const Limit)
+{
+   bool Postponed = false;
+   unsigned long long Size = 0;
+   for (pkgAcquire::ItemIterator I = Fetcher.ItemsBegin(); I < Fetcher.ItemsEnd();)
+   {
+      if ((*I)->Local == true || (*I)->Status == pkgAcquire::Item::StatDone || Size < Limit)
+      {
+	 Size += (*I)->FileSize;
+	 ++I;
+	 continue;
+      }
+      auto const Idx = I - Fetcher.ItemsBegin();
+      (*I)->Finished();
+      delete *I;
+      I = Fetcher.ItemsBegin() + Idx;
+      Postponed = true;
+   }
+   return Postponed;
+}
+									/*}}}*/
+// PrefetchNextBatch - Download the next batch while installing	/*{{{*/
+/* A child process requeues all archives and downloads the next batch into
+   the archives directory while the parent installs the current one. The
+   parent picks them up as already downloaded files on its next iteration
+   and downloads whatever the child failed to get on its own. The child
+   opens the list files again for its records: the file descriptors of the
+   parent share their offset with it, so reading through them would move
+   the parent's position, which e.g. the decompressors rely on. */
+static pid_t PrefetchNextBatch(pkgAcquire &Fetcher, pkgPackageManager &PM, pkgSourceList *const List,
+			       pkgCache &Cache, unsigned long long const Limit)
+{
+   pid_t const Child = ExecFork();
+   if (Child != 0)
+      return Child;
+
+   // the archives of the current batch are queued again in front
+   unsigned long long Batch = 0;
+   for (pkgAcquire::ItemIterator I = Fetcher.ItemsBegin(); I < Fetcher.ItemsEnd(); ++I)
+      Batch += (*I)->FileSize;
+
+   pkgRecords Recs(Cache);
+   Fetcher.Shutdown();
+   Fetcher.SetLog(nullptr);
+   if (PM.GetArchives(&Fetcher, List, &Recs) == false)
+      _exit(100);
+   PostponeDownloadsBeyond(Fetcher, Batch + Limit);
+   _exit(Fetcher.Run() == pkgAcquire::Continue ? 0 : 100);
+}
+									/*}}}*/
 #ifdef REQUIRE_MERGED_USR
 // \brief Issues a warning about usrmerge when destructed so we can call it after install finished or failed or whatever.
 struct WarnUsrMerge {
@@ -529,10 +587,16 @@ bool InstallPackages(CacheFile &Cache, APT::PackageVector &HeldBackPackages, boo
    if (_config->FindB("APT::Get::Download-Only",false) == true)
       _system->UnLock();
 
+   // Install in batches while the next one downloads if requested
+   unsigned long long PipelineSize = 0;
+   if (DownloadAllowed && _config->FindB("APT::Get::Download-Only", false) == false)
+      PipelineSize = std::max(0, _config->FindI("APT::Get::Pipeline-Install-Size", 0)) * 1024ull * 1024ull;
+
    // Run it
    bool Failed = false;
    while (1)
    {
+      bool const Postponed = PipelineSize != 0 && PostponeDownloadsBeyond(Fetcher, PipelineSize);
       bool Transient = false;
       if (AcquireRun(Fetcher, 0, &Failed, &Transient) == false)
 	 return false;
@@ -558,11 +622,20 @@ bool InstallPackages(CacheFile &Cache, APT::PackageVector &HeldBackPackages, boo
 	 return _error->Error(_("Aborting install."));
       }
 
+      pid_t const Prefetch = Postponed ? PrefetchNextBatch(Fetcher, *PM, List, Cache, PipelineSize) : -1;
+
       auto const progress = APT::Progress::PackageManagerProgressFactory();
       _system->UnLockInner();
       pkgPackageManager::OrderResult const Res = PM->DoInstall(progress);
       delete progress;
 
+      if (Prefetch > 0)
+      {
+	 if (Res == pkgPackageManager::Failed || _error->PendingError() == true)
+	    kill(Prefetch, SIGTERM);
+	 ExecWait(Prefetch, "prefetch", true);
+      }
+
       if (Res == pkgPackageManager::Failed || _error->PendingError() == true)
 	 return false;
       if (Res == pkgPackageManager::Completed)
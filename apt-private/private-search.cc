@@ -18,6 +18,7 @@
 #include <apt-private/private-json-hooks.h>
 #include <apt-private/private-output.h>
 #include <apt-private/private-search.h>
+#include <apt-private/private-searchindex.h>
 #include <apt-private/private-show.h>
 
 #include <cstring>
@@ -48,6 +49,27 @@ static std::vector<pkgCache::DescIterator> const TranslatedDescriptionsList(pkgC
    return Descriptions;
 }
 
+									/*}}}*/
+// DescriptionCandidates - Ask the search index about the patterns	/*{{{*/
+// ---------------------------------------------------------------------
+/* A description only needs to be read if the index can't rule out that
+   it matches all patterns which do not already match the package name */
+static std::vector<std::vector<bool>> DescriptionCandidates(SearchIndex const &Index, CommandLine const &CmdL)
+{
+   std::vector<std::vector<bool>> Candidates;
+   for (unsigned int I = 1; I < CmdL.FileSize(); ++I)
+      Candidates.push_back(Index.Candidates(CmdL.FileList[I]));
+   return Candidates;
+}
+static bool DescriptionMayMatch(std::vector<std::vector<bool>> const &Candidates,
+				std::vector<bool> const &NameMatches, pkgCache::DescIterator const &Desc)
+{
+   for (size_t I = 0; I < Candidates.size(); ++I)
+      if (NameMatches[I] == false && Candidates[I].empty() == false &&
+	  (Desc->ID >= Candidates[I].size() || Candidates[I][Desc->ID] == false))
+	 return false;
+   return true;
+}
 									/*}}}*/
 static bool FullTextSearch(CommandLine &CmdL)				/*{{{*/
 {
@@ -90,6 +112,10 @@ static bool FullTextSearch(CommandLine &CmdL)				/*{{{*/
    GetLocalitySortedVersionSet(CacheFile, &bag, &progress);
    LocalitySortedVersionSet::iterator V = bag.begin();
 
+   std::vector<std::vector<bool>> Candidates;
+   if (_config->FindB("APT::Cache::NamesOnly", false) == false)
+      Candidates = DescriptionCandidates(SearchIndex(CacheFile, &progress), CmdL);
+
    progress.OverallProgress(50, 100, 50,  _("Full Text Search"));
    progress.SubProgress(bag.size());
    pkgRecords records(CacheFile);
@@ -114,11 +140,18 @@ static bool FullTextSearch(CommandLine &CmdL)				/*{{{*/
       if (PkgsDone[P->ID] == true)
 	 continue;
 
+      char const * const PkgName = P.Name();
+      std::vector<bool> NameMatches;
+      for (auto const &pattern : Patterns)
+         NameMatches.push_back(regexec(&pattern, PkgName, 0, 0, 0) == 0);
+
       std::vector<std::string> PkgDescriptions;
       if (not NamesOnly)
       {
          for (auto &Desc: TranslatedDescriptionsList(V))
          {
+            if (not DescriptionMayMatch(Candidates, NameMatches, Desc))
+               continue;
             pkgRecords::Parser &parser = records.Lookup(Desc.FileList());
             PkgDescriptions.push_back(parser.LongDesc());
          }
@@ -126,12 +159,11 @@ static bool FullTextSearch(CommandLine &CmdL)				/*{{{*/
 
       bool all_found = true;
 
-      char const * const PkgName = P.Name();
       std::vector<bool> SkipDescription(PkgDescriptions.size(), false);
       for (std::vector<regex_t>::const_iterator pattern = Patterns.begin();
            pattern != Patterns.end(); ++pattern)
       {
-         if (regexec(&(*pattern), PkgName, 0, 0, 0) == 0)
+         if (NameMatches[pattern - Patterns.begin()])
             continue;
          else if (not NamesOnly)
          {
@@ -330,6 +362,10 @@ static bool Search(CommandLine &CmdL)
 
    LocalitySort(&DFList->Df, Cache->HeaderP->GroupCount, sizeof(*DFList));
 
+   std::vector<std::vector<bool>> Candidates;
+   if (NamesOnly == false)
+      Candidates = DescriptionCandidates(SearchIndex(CacheFile, nullptr), CmdL);
+
    // Create the text record parser
    pkgRecords Recs(*Cache);
    // Iterate over all the version records and check them
@@ -338,9 +374,12 @@ static bool Search(CommandLine &CmdL)
       size_t const PatternOffset = J->ID * NumPatterns;
       if (not NamesOnly)
       {
+         std::vector<bool> const NameMatches(PatternMatch + PatternOffset, PatternMatch + PatternOffset + NumPatterns);
          std::vector<std::string> PkgDescriptions;
          for (auto &Desc: TranslatedDescriptionsList(J->V))
          {
+            if (not DescriptionMayMatch(Candidates, NameMatches, Desc))
+               continue;
             pkgRecords::Parser &parser = Recs.Lookup(Desc.FileList());
             PkgDescriptions.push_back(parser.LongDesc());
          }
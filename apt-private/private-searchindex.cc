@@ -0,0 +1,438 @@
+// Includes								/*{{{*/
+#include <config.h>
+
+#include <apt-pkg/aptconfiguration.h>
+#include <apt-pkg/cachefile.h>
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+#include <apt-pkg/fileutl.h>
+#include <apt-pkg/pkgcache.h>
+#include <apt-pkg/pkgrecords.h>
+#include <apt-pkg/progress.h>
+#include <apt-pkg/strutl.h>
+
+#include <apt-private/private-searchindex.h>
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <apti18n.h>
+									/*}}}*/
+
+/* The index file starts with a header, followed by the description ID of
+   each document, a table of all trigrams sorted by value and the lists of
+   documents containing them. Documents are numbered in the order their
+   descriptions appear in the files, each list stores the differences
+   between consecutive document numbers as variable length integers. */
+namespace
+{
+struct SearchIndexHeader
+{
+   char Signature[8];
+   uint64_t Key;
+   uint32_t DescriptionCount;
+   uint32_t DocCount;
+   uint32_t TrigramCount;
+   uint32_t Padding;
+};
+struct SearchIndexTrigram
+{
+   uint32_t Trigram;
+   uint32_t Count;
+   uint64_t Offset;
+};
+constexpr char SearchIndexSignature[8] = {'A', 'P', 'T', 'S', 'R', 'C', 'H', '1'};
+} // namespace
+
+// Trigrams are case insensitive for ASCII like the REG_ICASE matching
+static unsigned char FoldCase(unsigned char const c)
+{
+   return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+static uint32_t MakeTrigram(unsigned char const *const s)
+{
+   return (uint32_t(s[0]) << 16) | (uint32_t(s[1]) << 8) | s[2];
+}
+// RequiredTrigrams - Trigrams every match of a regex contains		/*{{{*/
+// ---------------------------------------------------------------------
+/* Collects the literal strings a match of the extended regular expression
+   has to contain. This is deliberately conservative: alternatives make the
+   whole pattern unusable and groups, bracket expressions and everything
+   else which is not a plain character just ends the current string.
+   Trigrams with non-ASCII characters are ignored as their case folding
+   depends on the locale. Returns false if nothing is required. */
+static bool RequiredTrigrams(char const *const Pattern, std::vector<uint32_t> &Trigrams)
+{
+   std::vector<std::string> Literals(1);
+   auto const Break = [&]() {
+      if (Literals.back().empty() == false)
+	 Literals.emplace_back();
+   };
+   int Depth = 0;
+   for (char const *p = Pattern; *p != '\0'; ++p)
+   {
+      switch (*p)
+      {
+      case '|':
+	 if (Depth == 0)
+	    return false;
+	 break;
+      case '(':
+	 ++Depth;
+	 Break();
+	 break;
+      case ')':
+	 if (Depth != 0)
+	    --Depth;
+	 Break();
+	 break;
+      case '*':
+      case '?':
+      case '{':
+	 // the previous character is optional
+	 if (Depth == 0 && Literals.back().empty() == false)
+	    Literals.back().pop_back();
+	 Break();
+	 if (*p == '{')
+	 {
+	    p = strchr(p, '}');
+	    if (p == nullptr)
+	       goto done;
+	 }
+	 break;
+      case '[':
+	 Break();
+	 ++p;
+	 if (*p == '^')
+	    ++p;
+	 if (*p == ']')
+	    ++p;
+	 for (; *p != ']'; ++p)
+	 {
+	    if (*p == '\0')
+	       goto done;
+	    // character classes like [:alpha:] contain a ] of their own
+	    if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+	    {
+	       char const Close[] = {p[1], ']', '\0'};
+	       p = strstr(p + 2, Close);
+	       if (p == nullptr)
+		  goto done;
+	       ++p;
+	    }
+	 }
+	 break;
+      case '\\':
+	 ++p;
+	 if (*p == '\0')
+	    goto done;
+	 if (Depth == 0 && strchr("^.[]$()|*+?{}\\", *p) != nullptr)
+	    Literals.back().push_back(FoldCase(*p));
+	 else
+	    Break();
+	 break;
+      case '+':
+      case '.':
+      case '^':
+      case '$':
+	 Break();
+	 break;
+      default:
+	 if (Depth == 0)
+	    Literals.back().push_back(FoldCase(*p));
+	 break;
+      }
+   }
+done:
+   for (auto const &L : Literals)
+   {
+      auto const s = reinterpret_cast<unsigned char const *>(L.c_str());
+      for (size_t i = 0; i + 3 <= L.length(); ++i)
+	 if (s[i] < 0x80 && s[i + 1] < 0x80 && s[i + 2] < 0x80)
+	    Trigrams.push_back(MakeTrigram(s + i));
+   }
+   std::sort(Trigrams.begin(), Trigrams.end());
+   Trigrams.erase(std::unique(Trigrams.begin(), Trigrams.end()), Trigrams.end());
+   return Trigrams.empty() == false;
+}
+									/*}}}*/
+// IndexKey - Identify the descriptions the index was built for	/*{{{*/
+// ---------------------------------------------------------------------
+/* Description IDs are only meaningful for one cache, and translations can
+   change without a change of the cache, so the key covers all index files
+   and every description as well as the languages used to pick the texts */
+static uint64_t IndexKey(pkgCache &Cache, std::vector<pkgCache::Description *> const &Descs)
+{
+   std::string Key;
+   for (auto const &Lang : APT::Configuration::getLanguages())
+      Key.append(Lang).append(" ");
+   Key.append("\n");
+   for (auto F = Cache.FileBegin(); F.end() == false; ++F)
+      strprintf(Key, "%s%s %llu %lld\n", Key.c_str(), F.FileName(), (unsigned long long)F->Size, (long long)F->mtime);
+   for (auto const D : Descs)
+   {
+      if (D == nullptr)
+      {
+	 Key.append("-\n");
+	 continue;
+      }
+      pkgCache::DescIterator const Desc(Cache, D);
+      pkgCache::DescFileIterator const DF = Desc.FileList();
+      Key.append(Desc.LanguageCode()).append(" ").append(Desc.md5()).append(" ");
+      Key.append(std::to_string(static_cast<unsigned int>(DF.File()->ID))).append(" ").append(std::to_string(DF->Offset)).append("\n");
+   }
+   auto const Hash = std::hash<std::string>{}(Key);
+   return Hash == 0 ? 1 : Hash;
+}
+									/*}}}*/
+SearchIndex::SearchIndex(pkgCacheFile &CacheFile, OpProgress *const Progress) /*{{{*/
+{
+   std::string const FileName = _config->FindFile("Dir::Cache::searchindex");
+   pkgCache *const Cache = CacheFile.GetPkgCache();
+   if (FileName.empty() == true || Cache == nullptr)
+      return;
+
+   DescriptionCount = Cache->Head().DescriptionCount;
+   std::vector<pkgCache::Description *> Descs(DescriptionCount);
+   for (auto P = Cache->PkgBegin(); P.end() == false; ++P)
+      for (auto V = P.VersionList(); V.end() == false; ++V)
+	 for (auto D = V.DescriptionList(); D.end() == false; ++D)
+	    if (D->ID < Descs.size())
+	       Descs[D->ID] = D;
+   uint64_t const Key = IndexKey(*Cache, Descs);
+
+   if (Load(FileName, Key) == true)
+      return;
+   // not being able to use or write the index (e.g. as a user) is no error,
+   // but reading all the descriptions just to fail at the end is a waste
+   if (access(flNotFile(FileName).c_str(), W_OK) != 0)
+      return;
+   _error->PushToStack();
+   if (Build(CacheFile, Descs, FileName, Key, Progress) == false)
+      Unmap();
+   else
+      Load(FileName, Key);
+   _error->RevertToStack();
+}
+SearchIndex::~SearchIndex()
+{
+   Unmap();
+}
+									/*}}}*/
+void SearchIndex::Unmap()						/*{{{*/
+{
+   if (Map != nullptr)
+      munmap(Map, MapSize);
+   Map = nullptr;
+   MapSize = 0;
+}
+									/*}}}*/
+// SearchIndex::Load - Map an index file if it is up-to-date		/*{{{*/
+bool SearchIndex::Load(std::string const &FileName, uint64_t const Key)
+{
+   if (RealFileExists(FileName) == false)
+      return false;
+   Unmap();
+   _error->PushToStack();
+   FileFd File(FileName, FileFd::ReadOnly, FileFd::None);
+   if (File.IsOpen() == true && File.Size() >= sizeof(SearchIndexHeader))
+   {
+      MapSize = File.Size();
+      Map = mmap(nullptr, MapSize, PROT_READ, MAP_SHARED, File.Fd(), 0);
+      if (Map == MAP_FAILED)
+	 Map = nullptr;
+   }
+   bool Okay = Map != nullptr;
+   if (Okay)
+   {
+      SearchIndexHeader Header;
+      memcpy(&Header, Map, sizeof(Header));
+      Okay = memcmp(Header.Signature, SearchIndexSignature, sizeof(Header.Signature)) == 0 &&
+	     Header.Key == Key && Header.DescriptionCount == DescriptionCount &&
+	     MapSize >= sizeof(Header) + Header.DocCount * sizeof(uint32_t) +
+			    Header.TrigramCount * sizeof(SearchIndexTrigram);
+      DocCount = Header.DocCount;
+      TrigramCount = Header.TrigramCount;
+   }
+   _error->RevertToStack();
+   if (Okay == false)
+      Unmap();
+   return Okay;
+}
+									/*}}}*/
+// SearchIndex::Build - Write a new index file				/*{{{*/
+bool SearchIndex::Build(pkgCacheFile &CacheFile, std::vector<pkgCache::Description *> const &Descs,
+			std::string const &FileName, uint64_t const Key, OpProgress *const Progress)
+{
+   pkgCache &Cache = *CacheFile.GetPkgCache();
+
+   // read the descriptions in the order they are stored in the files
+   std::vector<std::pair<pkgCache::DescFile *, uint32_t>> Docs;
+   for (auto const D : Descs)
+      if (D != nullptr && D->FileList != 0)
+	 Docs.emplace_back(Cache.DescFileP + D->FileList, D->ID);
+   std::sort(Docs.begin(), Docs.end(), [](auto const &A, auto const &B) {
+      if (A.first->File != B.first->File)
+	 return A.first->File < B.first->File;
+      return A.first->Offset < B.first->Offset;
+   });
+
+   struct Postings
+   {
+      uint32_t Last = 0;
+      uint32_t Count = 0;
+      std::string Data;
+   };
+   std::unordered_map<uint32_t, Postings> Index;
+   std::vector<uint32_t> Trigrams;
+   pkgRecords Recs(Cache);
+   if (Progress != nullptr)
+      Progress->SubProgress(Docs.size(), _("Building search index"));
+   for (uint32_t Doc = 0; Doc < Docs.size(); ++Doc)
+   {
+      if (Progress != nullptr && Doc % 500 == 0)
+	 Progress->Progress(Doc);
+      std::string Text = Recs.Lookup(pkgCache::DescFileIterator(Cache, Docs[Doc].first)).LongDesc();
+      std::transform(Text.begin(), Text.end(), Text.begin(), FoldCase);
+      auto const s = reinterpret_cast<unsigned char const *>(Text.c_str());
+      Trigrams.clear();
+      for (size_t i = 0; i + 3 <= Text.length(); ++i)
+	 Trigrams.push_back(MakeTrigram(s + i));
+      std::sort(Trigrams.begin(), Trigrams.end());
+      Trigrams.erase(std::unique(Trigrams.begin(), Trigrams.end()), Trigrams.end());
+      for (auto const T : Trigrams)
+      {
+	 auto &P = Index[T];
+	 for (uint32_t Delta = Doc - P.Last; ; Delta >>= 7)
+	 {
+	    if (Delta < 0x80)
+	    {
+	       P.Data.push_back(Delta);
+	       break;
+	    }
+	    P.Data.push_back((Delta & 0x7f) | 0x80);
+	 }
+	 P.Last = Doc;
+	 ++P.Count;
+      }
+   }
+   if (_error->PendingError() == true)
+      return false;
+
+   SearchIndexHeader Header{};
+   memcpy(Header.Signature, SearchIndexSignature, sizeof(Header.Signature));
+   Header.Key = Key;
+   Header.DescriptionCount = Descs.size();
+   Header.DocCount = Docs.size();
+   Header.TrigramCount = Index.size();
+
+   std::vector<uint32_t> DocDescs;
+   DocDescs.reserve(Docs.size());
+   for (auto const &D : Docs)
+      DocDescs.push_back(D.second);
+
+   std::vector<SearchIndexTrigram> Table;
+   Table.reserve(Index.size());
+   for (auto const &I : Index)
+      Table.push_back({I.first, I.second.Count, 0});
+   std::sort(Table.begin(), Table.end(), [](auto const &A, auto const &B) { return A.Trigram < B.Trigram; });
+   uint64_t Offset = sizeof(Header) + DocDescs.size() * sizeof(DocDescs[0]) + Table.size() * sizeof(Table[0]);
+   for (auto &T : Table)
+   {
+      T.Offset = Offset;
+      Offset += Index[T.Trigram].Data.size();
+   }
+
+   FileFd Out(FileName, FileFd::WriteAtomic, FileFd::None, 0644);
+   bool Okay = Out.IsOpen() &&
+	       Out.Write(&Header, sizeof(Header)) &&
+	       Out.Write(DocDescs.data(), DocDescs.size() * sizeof(DocDescs[0])) &&
+	       Out.Write(Table.data(), Table.size() * sizeof(Table[0]));
+   for (auto const &T : Table)
+   {
+      if (Okay == false)
+	 break;
+      auto const &Data = Index[T.Trigram].Data;
+      Okay = Out.Write(Data.data(), Data.size());
+   }
+   if (Okay == false || Out.Close() == false)
+   {
+      Out.OpFail();
+      return false;
+   }
+   return true;
+}
+									/*}}}*/
+// SearchIndex::Candidates - Descriptions which can match a pattern	/*{{{*/
+std::vector<bool> SearchIndex::Candidates(char const *const Pattern) const
+{
+   std::vector<uint32_t> Trigrams;
+   if (Map == nullptr || RequiredTrigrams(Pattern, Trigrams) == false)
+      return {};
+
+   auto const Base = static_cast<unsigned char const *>(Map);
+   auto const Size = MapSize;
+   auto const DocDescs = reinterpret_cast<uint32_t const *>(Base + sizeof(SearchIndexHeader));
+   auto const Table = reinterpret_cast<SearchIndexTrigram const *>(DocDescs + DocCount);
+   auto const TableEnd = Table + TrigramCount;
+
+   // look at the shortest lists first to keep the intersection small
+   std::vector<SearchIndexTrigram const *> Lists;
+   for (auto const T : Trigrams)
+   {
+      auto const I = std::lower_bound(Table, TableEnd, T, [](auto const &A, uint32_t const B) { return A.Trigram < B; });
+      if (I == TableEnd || I->Trigram != T)
+	 return std::vector<bool>(DescriptionCount, false);
+      Lists.push_back(I);
+   }
+   std::sort(Lists.begin(), Lists.end(), [](auto const A, auto const B) { return A->Count < B->Count; });
+
+   std::vector<uint32_t> Docs, Next;
+   for (size_t L = 0; L < Lists.size(); ++L)
+   {
+      Next.clear();
+      auto D = Docs.cbegin();
+      uint64_t Pos = Lists[L]->Offset;
+      uint32_t Doc = 0;
+      for (uint32_t C = 0; C < Lists[L]->Count; ++C)
+      {
+	 uint32_t Delta = 0;
+	 for (unsigned int Shift = 0; Pos < Size; Shift += 7)
+	 {
+	    unsigned char const Byte = Base[Pos++];
+	    Delta |= uint32_t(Byte & 0x7f) << Shift;
+	    if ((Byte & 0x80) == 0)
+	       break;
+	 }
+	 Doc += Delta;
+	 if (L == 0)
+	    Next.push_back(Doc);
+	 else
+	 {
+	    while (D != Docs.cend() && *D < Doc)
+	       ++D;
+	    if (D == Docs.cend())
+	       break;
+	    if (*D == Doc)
+	       Next.push_back(Doc);
+	 }
+      }
+      Docs.swap(Next);
+      if (Docs.empty())
+	 break;
+   }
+
+   std::vector<bool> Result(DescriptionCount, false);
+   for (auto const Doc : Docs)
+      if (Doc < DocCount && DocDescs[Doc] < DescriptionCount)
+	 Result[DocDescs[Doc]] = true;
+   return Result;
+}
+									/*}}}*/
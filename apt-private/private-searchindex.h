@@ -0,0 +1,43 @@
+#ifndef APT_PRIVATE_SEARCHINDEX_H
+#define APT_PRIVATE_SEARCHINDEX_H
+
+#include <apt-pkg/pkgcache.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class OpProgress;
+class pkgCacheFile;
+
+/* An inverted index of the trigrams in all descriptions of the cache,
+   stored in Dir::Cache::searchindex. It can only rule out descriptions,
+   so all candidates it returns still need to be checked with regexec. */
+class SearchIndex
+{
+   // the read-only mapping of the index file, MMap is private to libapt-pkg
+   void *Map = nullptr;
+   size_t MapSize = 0;
+   uint32_t DocCount = 0;
+   uint32_t TrigramCount = 0;
+   uint32_t DescriptionCount = 0;
+
+   bool Load(std::string const &FileName, uint64_t Key);
+   void Unmap();
+   static bool Build(pkgCacheFile &CacheFile, std::vector<pkgCache::Description *> const &Descs,
+		     std::string const &FileName, uint64_t Key, OpProgress *Progress);
+
+   public:
+   /* Opens the index or builds it if it is missing or outdated, does
+      nothing if no Dir::Cache::searchindex is configured */
+   SearchIndex(pkgCacheFile &CacheFile, OpProgress *Progress);
+   ~SearchIndex();
+
+   /* Returns for each description ID if its long description can match
+      the extended regular expression, or an empty vector if the index
+      can not narrow down the candidates for this pattern */
+   std::vector<bool> Candidates(char const *Pattern) const;
+};
+
+#endif
@@ -26,9 +26,12 @@
 #include <apt-private/private-install.h>
 #include <apt-private/private-show.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <ostream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <unistd.h>
 
 #include <apti18n.h>
@@ -36,14 +39,20 @@
 
 using APT::Configuration::color;
 
-pkgRecords::Parser &LookupParser(pkgRecords &Recs, pkgCache::VerIterator const &V, pkgCache::VerFileIterator &Vf) /*{{{*/
+static pkgCache::VerFileIterator RecordFile(pkgCache::VerIterator const &V) /*{{{*/
 {
-   Vf = V.FileList();
+   auto Vf = V.FileList();
    for (; Vf.end() == false; ++Vf)
       if ((Vf.File()->Flags & pkgCache::Flag::NotSource) == 0)
 	 break;
    if (Vf.end() == true)
       Vf = V.FileList();
+   return Vf;
+}
+									/*}}}*/
+pkgRecords::Parser &LookupParser(pkgRecords &Recs, pkgCache::VerIterator const &V, pkgCache::VerFileIterator &Vf) /*{{{*/
+{
+   Vf = RecordFile(V);
    return Recs.Lookup(Vf);
 }
 									/*}}}*/
@@ -367,21 +376,37 @@ bool ShowPackage(CommandLine &CmdL)					/*{{{*/
    if (not InitOutputPager())
       return false;
 
-   for (APT::VersionList::const_iterator Ver = verset.begin(); Ver != verset.end(); ++Ver)
+   // the records are read in batches in file order, but shown in the requested order
+   std::vector<pkgCache::VerIterator> const Versions(verset.begin(), verset.end());
+   constexpr size_t BatchSize = 1000;
+   for (size_t First = 0; First < Versions.size(); First += BatchSize)
    {
-      pkgCache::VerFileIterator Vf;
-      auto &Parser = LookupParser(Recs, Ver, Vf);
-      char const *Start, *Stop;
-      Parser.GetRec(Start, Stop);
-      size_t const Length = Stop - Start;
-
-      if (ShowVersion <= 1)
+      auto const Last = std::min(Versions.size(), First + BatchSize);
+      std::vector<pkgCache::VerFileIterator> VerFiles;
+      for (auto I = First; I < Last; ++I)
+	 VerFiles.push_back(RecordFile(Versions[I]));
+      // the V2 display expects the character after the record to be readable
+      std::unordered_map<pkgCache::VerFile const *, std::string> Records;
+      Recs.ForEach(VerFiles, [&](pkgCache::VerFileIterator const &Vf, pkgRecords::Parser &Parser) {
+	 char const *Start, *Stop;
+	 Parser.GetRec(Start, Stop);
+	 Records.try_emplace(static_cast<pkgCache::VerFile const *>(Vf), Start, Stop - Start + (ShowVersion <= 1 ? 0 : 1));
+	 return true;
+      });
+
+      for (auto I = First; I < Last; ++I)
       {
-	 if (DisplayRecordV1(CacheFile, Recs, Ver, Vf, Start, Length, std::cout) == false)
+	 auto const &Ver = Versions[I];
+	 auto const &Vf = VerFiles[I - First];
+	 auto const &Record = Records[static_cast<pkgCache::VerFile const *>(Vf)];
+	 if (ShowVersion <= 1)
+	 {
+	    if (DisplayRecordV1(CacheFile, Recs, Ver, Vf, Record.data(), Record.length(), std::cout) == false)
+	       return false;
+	 }
+	 else if (DisplayRecordV2(CacheFile, Recs, Ver, Vf, Record.data(), Record.length(), c1out) == false)
 	    return false;
       }
-      else if (DisplayRecordV2(CacheFile, Recs, Ver, Vf, Start, Length + 1, c1out) == false)
-	 return false;
    }
 
    if (select == APT::CacheSetHelper::CANDIDATE && normalPackages != 0)
@@ -33,6 +33,7 @@
 #include <cstring>
 #include <iostream>
 #include <list>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <libgen.h>
@@ -150,7 +151,14 @@ int main(int argc,const char *argv[])					/*{{{*/
 
 	EDSP::WriteProgress(5, "Read scenario…", output);
 
-	pkgCacheFile CacheFile;
+	std::unique_ptr<pkgCacheFile> Scenario;
+	if (flags & EDSP::Request::BINARY_SCENARIO)
+		Scenario = EDSP::ReadBinaryScenario(input);
+	else
+		Scenario.reset(new pkgCacheFile());
+	if (Scenario == nullptr)
+		DIE("Failed to read the binary scenario!");
+	pkgCacheFile &CacheFile = *Scenario;
 	CacheFile.InhibitActionGroups(true);
 	if (CacheFile.Open(NULL, false) == false)
 		DIE("Failed to open CacheFile!");
@@ -23,6 +23,7 @@
 #include <apt-private/private-output.h>
 
 #include <algorithm>
+#include <cerrno>
 #include <chrono>
 #include <climits>
 #include <clocale>
@@ -31,10 +32,17 @@
 #include <ctime>
 #include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <sstream>
 #include <string>
 #include <vector>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "apt-ftparchive.h"
 #include "cachedb.h"
@@ -623,6 +631,7 @@ static bool ShowHelp(CommandLine &)					/*{{{*/
       "          release path\n"
       "          generate config [groups]\n"
       "          clean config\n"
+      "          convert-db olddb newdb\n"
       "\n"
       "apt-ftparchive generates index files for Debian archives. It supports\n"
       "many styles of generation from fully automated to functional replacements\n"
@@ -773,6 +782,181 @@ static bool SimpleGenRelease(CommandLine &CmdL)
    return true;
 }
 
+									/*}}}*/
+// RunGenerateJobs - Generate the Packages and Sources files		/*{{{*/
+// ---------------------------------------------------------------------
+/* With APT::FTPArchive::Generate::Jobs set to more than one, the jobs are
+   split into chains which share no cache database, translation file or
+   output file with each other. Each chain is run in order in its own
+   process, so the generated files are exactly the same as for a serial
+   run. The console output of a chain is collected and shown once it is
+   complete, in the order the chains would have run serially. */
+struct GenerateJob
+{
+   PackageMap *Map;
+   bool Sources;
+};
+static bool RunGenerateJobs(Configuration &Setup, std::vector<GenerateJob> const &Jobs,
+			    struct CacheDB::Stats &SrcStats, struct CacheDB::Stats &Stats)
+{
+   long Parallel = _config->FindI("APT::FTPArchive::Generate::Jobs", 1);
+   if (Parallel == 0)
+      Parallel = std::max(1l, sysconf(_SC_NPROCESSORS_ONLN));
+   // the DeLink limit is shared by all jobs, so they have to run one after the other
+   if (Parallel <= 1 || Jobs.size() < 2 ||
+       std::any_of(Jobs.begin(), Jobs.end(), [](GenerateJob const &J) { return J.Map->DeLinkLimit != 0; }))
+   {
+      for (auto const &J : Jobs)
+	 if ((J.Sources ? J.Map->GenSources(Setup, SrcStats) : J.Map->GenPackages(Setup, Stats)) == false)
+	    _error->DumpErrors();
+      return true;
+   }
+
+   // jobs sharing a resource end up in the same chain
+   std::vector<size_t> Parent(Jobs.size());
+   std::iota(Parent.begin(), Parent.end(), 0);
+   std::function<size_t(size_t)> const Find = [&](size_t const I) {
+      return Parent[I] == I ? I : (Parent[I] = Find(Parent[I]));
+   };
+   std::map<std::string, size_t> Users;
+   auto const Use = [&](size_t const I, std::string const &Resource) {
+      auto const U = Users.emplace(Resource, I);
+      if (U.second == false)
+	 Parent[Find(I)] = Find(U.first->second);
+   };
+   std::string const CacheDir = Setup.FindDir("Dir::CacheDir");
+   std::string const ArchiveDir = Setup.FindDir("Dir::ArchiveDir");
+   for (size_t I = 0; I < Jobs.size(); ++I)
+   {
+      PackageMap const &M = *Jobs[I].Map;
+      if (Jobs[I].Sources)
+      {
+	 Use(I, "db:" + flCombine(CacheDir, M.SrcCacheDB));
+	 Use(I, "file:" + flCombine(ArchiveDir, M.SrcFile));
+      }
+      else
+      {
+	 Use(I, "db:" + flCombine(CacheDir, M.BinCacheDB));
+	 Use(I, "file:" + flCombine(ArchiveDir, M.PkgFile));
+	 if (M.TransWriter != nullptr)
+	    Use(I, "trans:" + std::to_string(reinterpret_cast<uintptr_t>(M.TransWriter)));
+      }
+   }
+   std::vector<std::vector<size_t>> Chains;
+   std::map<size_t, size_t> ChainOf;
+   for (size_t I = 0; I < Jobs.size(); ++I)
+   {
+      auto const C = ChainOf.emplace(Find(I), Chains.size());
+      if (C.second)
+	 Chains.emplace_back();
+      Chains[C.first->second].push_back(I);
+   }
+
+   struct Worker
+   {
+      pid_t Pid = -1;
+      // the worker holds the write end open until it exits
+      int Pipe = -1;
+      std::unique_ptr<FileFd> Result;
+      bool Done = false;
+   };
+   std::vector<Worker> Workers(Chains.size());
+   size_t Started = 0, Shown = 0, Running = 0;
+   while (Shown < Chains.size())
+   {
+      for (; Running < static_cast<size_t>(Parallel) && Started < Chains.size(); ++Started, ++Running)
+      {
+	 auto &W = Workers[Started];
+	 W.Result.reset(GetTempFile("apt-ftparchive-generate", true));
+	 if (W.Result == nullptr)
+	    return false;
+	 for (auto const I : Chains[Started])
+	 {
+	    PackageMap &M = *Jobs[I].Map;
+	    if (Jobs[I].Sources && M.SrcFile.empty() == false)
+	       M.SrcDone = true;
+	    else if (Jobs[I].Sources == false && M.PkgFile.empty() == false)
+	       M.PkgDone = true;
+	 }
+	 int Fds[2];
+	 if (pipe(Fds) != 0)
+	    return _error->Errno("pipe", "Failed to create IPC pipe to subprocess");
+	 cout << flush;
+	 clog << flush;
+	 W.Pid = ExecFork();
+	 if (W.Pid == 0)
+	 {
+	    close(Fds[0]);
+	    std::ostringstream Out;
+	    if (c0out.rdbuf() == clog.rdbuf())
+	       c0out.rdbuf(Out.rdbuf());
+	    if (c1out.rdbuf() == clog.rdbuf())
+	       c1out.rdbuf(Out.rdbuf());
+	    struct CacheDB::Stats ChainStats[2];
+	    for (auto const I : Chains[Started])
+	       if ((Jobs[I].Sources ? Jobs[I].Map->GenSources(Setup, ChainStats[1]) : Jobs[I].Map->GenPackages(Setup, ChainStats[0])) == false)
+		  _error->DumpErrors(Out);
+	    _error->DumpErrors(Out);
+	    cout << flush;
+	    std::string const Text = Out.str();
+	    if (W.Result->Write(ChainStats, sizeof(ChainStats)) == false ||
+		W.Result->Write(Text.data(), Text.length()) == false)
+	       _exit(100);
+	    _exit(0);
+	 }
+	 close(Fds[1]);
+	 W.Pipe = Fds[0];
+      }
+
+      // wait for whichever worker finishes first
+      std::vector<struct pollfd> Polls;
+      std::vector<size_t> Polled;
+      for (size_t C = Shown; C < Started; ++C)
+	 if (Workers[C].Done == false)
+	 {
+	    Polls.push_back({Workers[C].Pipe, POLLIN, 0});
+	    Polled.push_back(C);
+	 }
+      int Ready;
+      do
+	 Ready = poll(Polls.data(), Polls.size(), -1);
+      while (Ready < 0 && errno == EINTR);
+      size_t Finished = Polled.front();
+      for (size_t P = 0; Ready > 0 && P < Polls.size(); ++P)
+	 if (Polls[P].revents != 0)
+	 {
+	    Finished = Polled[P];
+	    break;
+	 }
+      bool const Okay = ExecWait(Workers[Finished].Pid, "apt-ftparchive", true);
+      close(Workers[Finished].Pipe);
+      Workers[Finished].Done = true;
+      --Running;
+      if (Okay == false)
+	 _error->Error(_("Error processing directory %s"), Jobs[Chains[Finished].front()].Map->BaseDir.c_str());
+
+      // show the results in order
+      for (; Shown < Started && Workers[Shown].Done; ++Shown)
+      {
+	 auto &Result = *Workers[Shown].Result;
+	 struct CacheDB::Stats ChainStats[2];
+	 std::string Text;
+	 auto const Size = Result.FileSize();
+	 if (Size >= sizeof(ChainStats))
+	    Text.resize(Size - sizeof(ChainStats));
+	 if (Size >= sizeof(ChainStats) && Result.Seek(0) && Result.Read(ChainStats, sizeof(ChainStats)) &&
+	     Result.Read(Text.data(), Text.length()))
+	 {
+	    Stats.Add(ChainStats[0]);
+	    SrcStats.Add(ChainStats[1]);
+	    clog << Text << flush;
+	 }
+	 Workers[Shown].Result.reset();
+	 _error->DumpErrors();
+      }
+   }
+   return true;
+}
 									/*}}}*/
 // DoGeneratePackagesAndSources - Helper for Generate                   /*{{{*/
 // ---------------------------------------------------------------------
@@ -782,14 +966,13 @@ static bool DoGeneratePackagesAndSources(Configuration &Setup,
 					 struct CacheDB::Stats &Stats,
 					 CommandLine &CmdL)
 {
+   std::vector<GenerateJob> Jobs;
    if (CmdL.FileSize() <= 2)
    {
       for (vector<PackageMap>::iterator I = PkgList.begin(); I != PkgList.end(); ++I)
-	 if (I->GenPackages(Setup,Stats) == false)
-	    _error->DumpErrors();
+	 Jobs.push_back({&(*I), false});
       for (vector<PackageMap>::iterator I = PkgList.begin(); I != PkgList.end(); ++I)
-	 if (I->GenSources(Setup,SrcStats) == false)
-	    _error->DumpErrors();
+	 Jobs.push_back({&(*I), true});
    }
    else
    {
@@ -816,35 +999,25 @@ static bool DoGeneratePackagesAndSources(Configuration &Setup,
       }
       _error->DumpErrors();
       
-      // Do the generation for Packages
-      for (End = List; End->Str != 0; ++End)
+      // Do the generation for Packages and then for Sources
+      for (bool const Sources : {false, true})
       {
-	 if (End->Hit == false)
-	    continue;
-	 
-	 PackageMap * const I = static_cast<PackageMap *>(End->UserData);
-	 if (I->PkgDone == true)
-	    continue;
-	 if (I->GenPackages(Setup,Stats) == false)
-	    _error->DumpErrors();
-      }
-      
-      // Do the generation for Sources
-      for (End = List; End->Str != 0; ++End)
-      {
-	 if (End->Hit == false)
-	    continue;
-	 
-	 PackageMap * const I = static_cast<PackageMap *>(End->UserData);
-	 if (I->SrcDone == true)
-	    continue;
-	 if (I->GenSources(Setup,SrcStats) == false)
-	    _error->DumpErrors();
+	 std::set<PackageMap *> Seen;
+	 for (End = List; End->Str != 0; ++End)
+	 {
+	    if (End->Hit == false)
+	       continue;
+
+	    PackageMap * const I = static_cast<PackageMap *>(End->UserData);
+	    if ((Sources ? I->SrcDone : I->PkgDone) == true || Seen.insert(I).second == false)
+	       continue;
+	    Jobs.push_back({I, Sources});
+	 }
       }
       
       delete [] List;
    }
-   return true;
+   return RunGenerateJobs(Setup, Jobs, SrcStats, Stats);
 }
 
                                                                         /*}}}*/
@@ -1002,12 +1175,18 @@ static bool Clean(CommandLine &CmdL)
          c0out << I->BinCacheDB << endl;
       if(I->SrcCacheDB != "")
          c0out << I->SrcCacheDB << endl;
-      CacheDB DB(flCombine(CacheDir,I->BinCacheDB));
-      CacheDB DB_SRC(flCombine(CacheDir,I->SrcCacheDB));
-      if (DB.Clean() == false)
-	 _error->DumpErrors();
-      if (DB_SRC.Clean() == false)
-	 _error->DumpErrors();
+      {
+	 CacheDB DB(flCombine(CacheDir,I->BinCacheDB));
+	 if (DB.Clean() == false)
+	    _error->DumpErrors();
+      }
+      // a database can only be opened for writing once at a time
+      if (I->SrcCacheDB != I->BinCacheDB)
+      {
+	 CacheDB DB_SRC(flCombine(CacheDir,I->SrcCacheDB));
+	 if (DB_SRC.Clean() == false)
+	    _error->DumpErrors();
+      }
 
       I = std::find_if(I, PkgList.end(),
 	    [&](PackageMap const &PM) { return PM.BinCacheDB != I->BinCacheDB || PM.SrcCacheDB != I->SrcCacheDB;
@@ -1017,6 +1196,16 @@ static bool Clean(CommandLine &CmdL)
    return true;
 }
 									/*}}}*/
+// ConvertDB - Convert a database into the log format			/*{{{*/
+// ---------------------------------------------------------------------
+/* */
+static bool ConvertDB(CommandLine &CmdL)
+{
+   if (CmdL.FileSize() != 3)
+      return ShowHelp(CmdL);
+   return CacheDB::Convert(CmdL.FileList[1], CmdL.FileList[2]);
+}
+									/*}}}*/
 
 static std::vector<aptDispatchWithHelp> GetCommands()			/*{{{*/
 {
@@ -1027,6 +1216,7 @@ static std::vector<aptDispatchWithHelp> GetCommands()			/*{{{*/
       {"release",&SimpleGenRelease, nullptr},
       {"generate",&Generate, nullptr},
       {"clean",&Clean, nullptr},
+      {"convert-db",&ConvertDB, nullptr},
       {nullptr, nullptr, nullptr}
    };
 }
@@ -19,19 +19,411 @@
 #include <apt-pkg/hashes.h>
 #include <apt-pkg/strutl.h>
 
+#include <algorithm>
 #include <cctype>
 #include <cstddef>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
 #include <netinet/in.h> // htonl, etc
 #include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_BDB
+#include <db.h>
+#endif
 
 #include "cachedb.h"
 
 #include <apti18n.h>
 									/*}}}*/
 
+// CacheDBBackend - Storage of the cache database			/*{{{*/
+// ---------------------------------------------------------------------
+/* The data returned by Get stays valid until the next call. */
+class CacheDBBackend
+{
+   public:
+   virtual bool Get(std::string_view const Key, std::string_view &Data) = 0;
+   virtual bool Put(std::string_view const Key, void const *const Data, size_t const Length) = 0;
+   virtual bool ForEach(std::function<bool(std::string_view Key, std::string_view Data)> const &Callback) = 0;
+   // Removes all records for which Keep returns false
+   virtual bool Clean(std::function<bool(std::string_view Key)> const &Keep) = 0;
+   virtual ~CacheDBBackend() = default;
+
+   static std::unique_ptr<CacheDBBackend> Open(std::string const &File, bool const ReadOnly);
+};
+									/*}}}*/
+#ifdef HAVE_BDB
+// BerkeleyCacheDB - Berkeley DB based storage				/*{{{*/
+class BerkeleyCacheDB : public CacheDBBackend
+{
+   DB *Dbp;
+
+   public:
+   static std::unique_ptr<CacheDBBackend> Open(std::string const &File, bool const ReadOnly)
+   {
+      DB *Dbp;
+      int err;
+      db_create(&Dbp, NULL, 0);
+      if ((err = Dbp->open(Dbp, NULL, File.c_str(), NULL, DB_BTREE,
+			   (ReadOnly?DB_RDONLY:DB_CREATE),
+			   0644)) != 0)
+      {
+	 if (err == DB_OLD_VERSION)
+	 {
+	    _error->Warning(_("DB is old, attempting to upgrade %s"),File.c_str());
+	    err = Dbp->upgrade(Dbp, File.c_str(), 0);
+	    if (!err)
+	       err = Dbp->open(Dbp, NULL, File.c_str(), NULL, DB_HASH,
+			       (ReadOnly?DB_RDONLY:DB_CREATE), 0644);
+
+	 }
+	 // the database format has changed from DB_HASH to DB_BTREE in 
+	 // apt 0.6.44
+	 if (err == EINVAL)
+	 {
+	    _error->Error(_("DB format is invalid. If you upgraded from an older version of apt, please remove and re-create the database."));
+	 }
+	 if (err)
+	 {
+	    Dbp->close(Dbp, 0);
+	    _error->Error(_("Unable to open DB file %s: %s"),File.c_str(), db_strerror(err));
+	    return nullptr;
+	 }
+      }
+      return std::unique_ptr<CacheDBBackend>(new BerkeleyCacheDB(Dbp));
+   }
+
+   bool Get(std::string_view const Key, std::string_view &Data) override
+   {
+      DBT K{}, D{};
+      K.data = const_cast<char *>(Key.data());
+      K.size = Key.size();
+      if (Dbp->get(Dbp, 0, &K, &D, 0) != 0)
+	 return false;
+      Data = std::string_view(static_cast<char const *>(D.data), D.size);
+      return true;
+   }
+   bool Put(std::string_view const Key, void const *const Data, size_t const Length) override
+   {
+      DBT K{}, D{};
+      K.data = const_cast<char *>(Key.data());
+      K.size = Key.size();
+      D.data = const_cast<void *>(Data);
+      D.size = Length;
+      return (errno = Dbp->put(Dbp, 0, &K, &D, 0)) == 0;
+   }
+   bool ForEach(std::function<bool(std::string_view Key, std::string_view Data)> const &Callback) override
+   {
+      DBC *Cursor;
+      if ((errno = Dbp->cursor(Dbp, NULL, &Cursor, 0)) != 0)
+	 return _error->Error(_("Unable to get a cursor"));
+      DBT K{}, D{};
+      bool Res = true;
+      while (Res && (errno = Cursor->c_get(Cursor, &K, &D, DB_NEXT)) == 0)
+	 Res = Callback(std::string_view(static_cast<char const *>(K.data), K.size),
+			std::string_view(static_cast<char const *>(D.data), D.size));
+      Cursor->c_close(Cursor);
+      return Res;
+   }
+   bool Clean(std::function<bool(std::string_view Key)> const &Keep) override
+   {
+      /* I'm not sure what VERSION_MINOR should be here.. 2.4.14 certainly
+	 needs the lower one and 2.7.7 needs the upper.. */
+      DBC *Cursor;
+      if ((errno = Dbp->cursor(Dbp, NULL, &Cursor, 0)) != 0)
+	 return _error->Error(_("Unable to get a cursor"));
+
+      DBT K{}, D{};
+      while ((errno = Cursor->c_get(Cursor,&K,&D,DB_NEXT)) == 0)
+      {
+	 if (Keep(std::string_view(static_cast<char const *>(K.data), K.size)))
+	    continue;
+	 Cursor->c_del(Cursor,0);
+      }
+      Cursor->c_close(Cursor);
+      int res = Dbp->compact(Dbp, NULL, NULL, NULL, NULL, DB_FREE_SPACE, NULL);
+      if (res < 0)
+	 _error->Warning("compact failed with result %i", res);
+
+      if(_config->FindB("Debug::APT::FTPArchive::Clean", false) == true)
+	 Dbp->stat_print(Dbp, 0);
+      return true;
+   }
+
+   explicit BerkeleyCacheDB(DB * const Dbp) : Dbp(Dbp) {}
+   ~BerkeleyCacheDB() override { Dbp->close(Dbp, 0); }
+};
+									/*}}}*/
+#endif
+// LogCacheDB - Append-only log of records read via mmap		/*{{{*/
+// ---------------------------------------------------------------------
+/* The file starts with a magic line followed by records, each a header
+   with the key and data lengths in network byte order and the key and
+   data themselves. Records are only ever appended, a later record for a
+   key replaces the earlier ones, Clean rewrites the file. An index of
+   all keys is built when the file is opened. Only one writer may use the
+   file at a time, readers need no lock as they only look at the records
+   which were complete when they opened the file. */
+class LogCacheDB : public CacheDBBackend
+{
+   struct RecordHeader
+   {
+      uint32_t KeyLength;
+      uint32_t DataLength;
+   };
+
+   std::string File;
+   bool ReadOnly;
+   int Fd = -1;
+   char *Map = nullptr;
+   size_t MapSize = 0;
+   uint64_t End = 0;
+   // keys point into the map or into NewKeys
+   std::unordered_map<std::string_view, uint64_t> Index;
+   std::deque<std::string> NewKeys;
+   std::string Buffer;
+
+   bool Load()
+   {
+      Fd = open(File.c_str(), ReadOnly ? O_RDONLY | O_CLOEXEC : O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (Fd == -1)
+	 return _error->Errno("open", _("Could not open file %s"), File.c_str());
+      if (ReadOnly == false && flock(Fd, LOCK_EX | LOCK_NB) != 0)
+	 return _error->Errno("flock", _("Unable to lock DB file %s"), File.c_str());
+
+      struct stat St;
+      if (fstat(Fd, &St) != 0)
+	 return _error->Errno("fstat", _("Failed to stat %s"), File.c_str());
+      if (St.st_size == 0 && ReadOnly == false)
+      {
+	 if (WriteAll(Magic.data(), Magic.size(), 0) == false)
+	    return false;
+	 St.st_size = Magic.size();
+      }
+      MapSize = St.st_size;
+      if (MapSize < Magic.size())
+	 return _error->Error(_("DB format is invalid. If you upgraded from an older version of apt, please remove and re-create the database."));
+      Map = static_cast<char *>(mmap(nullptr, MapSize, PROT_READ, MAP_SHARED, Fd, 0));
+      if (Map == MAP_FAILED)
+      {
+	 Map = nullptr;
+	 return _error->Errno("mmap", _("Couldn't make mmap of %lu bytes"), MapSize);
+      }
+      if (memcmp(Map, Magic.data(), Magic.size()) != 0)
+	 return _error->Error(_("DB format is invalid. If you upgraded from an older version of apt, please remove and re-create the database."));
+
+      // Index all complete records
+      End = Magic.size();
+      while (End + sizeof(RecordHeader) <= MapSize)
+      {
+	 RecordHeader Header;
+	 memcpy(&Header, Map + End, sizeof(Header));
+	 uint64_t const Length = sizeof(Header) + ntohl(Header.KeyLength) + ntohl(Header.DataLength);
+	 if (End + Length > MapSize)
+	    break;
+	 Index[std::string_view(Map + End + sizeof(Header), ntohl(Header.KeyLength))] = End;
+	 End += Length;
+      }
+      // An interrupted writer can leave an incomplete record behind
+      if (End != MapSize && ReadOnly == false && ftruncate(Fd, End) != 0)
+	 return _error->Errno("ftruncate", _("Unable to truncate %s"), File.c_str());
+      return true;
+   }
+   void Unload()
+   {
+      Index.clear();
+      NewKeys.clear();
+      if (Map != nullptr)
+	 munmap(Map, MapSize);
+      Map = nullptr;
+      MapSize = 0;
+      if (Fd != -1)
+	 close(Fd);
+      Fd = -1;
+   }
+   bool WriteAll(void const *Data, size_t Length, uint64_t Offset)
+   {
+      auto Start = static_cast<char const *>(Data);
+      while (Length != 0)
+      {
+	 ssize_t const Res = pwrite(Fd, Start, Length, Offset);
+	 if (Res < 0)
+	 {
+	    if (errno == EINTR)
+	       continue;
+	    return false;
+	 }
+	 Start += Res;
+	 Offset += Res;
+	 Length -= Res;
+      }
+      return true;
+   }
+   bool ReadRecord(uint64_t const Offset, std::string_view &Key, std::string_view &Data)
+   {
+      RecordHeader Header;
+      char const *Record = nullptr;
+      if (Offset + sizeof(Header) <= MapSize)
+      {
+	 memcpy(&Header, Map + Offset, sizeof(Header));
+	 Record = Map + Offset;
+      }
+      else if (pread(Fd, &Header, sizeof(Header), Offset) != sizeof(Header))
+	 return false;
+      uint64_t const Length = sizeof(Header) + ntohl(Header.KeyLength) + ntohl(Header.DataLength);
+      // records appended since the file was mapped are read directly
+      if (Offset + Length > MapSize)
+      {
+	 Buffer.resize(Length);
+	 if (pread(Fd, Buffer.data(), Length, Offset) != static_cast<ssize_t>(Length))
+	    return false;
+	 Record = Buffer.data();
+      }
+      Key = std::string_view(Record + sizeof(Header), ntohl(Header.KeyLength));
+      Data = std::string_view(Record + sizeof(Header) + Key.size(), ntohl(Header.DataLength));
+      return true;
+   }
+   std::vector<uint64_t> SortedOffsets() const
+   {
+      std::vector<uint64_t> Offsets;
+      Offsets.reserve(Index.size());
+      for (auto const &I : Index)
+	 Offsets.push_back(I.second);
+      std::sort(Offsets.begin(), Offsets.end());
+      return Offsets;
+   }
+
+   public:
+   static constexpr std::string_view Magic{"apt-cachedb-v1\n"};
+
+   bool Get(std::string_view const Key, std::string_view &Data) override
+   {
+      auto const I = Index.find(Key);
+      std::string_view StoredKey;
+      return I != Index.end() && ReadRecord(I->second, StoredKey, Data);
+   }
+   bool Put(std::string_view const Key, void const *const Data, size_t const Length) override
+   {
+      RecordHeader const Header{htonl(Key.size()), htonl(Length)};
+      std::string Record;
+      Record.reserve(sizeof(Header) + Key.size() + Length);
+      Record.append(reinterpret_cast<char const *>(&Header), sizeof(Header));
+      Record.append(Key);
+      Record.append(static_cast<char const *>(Data), Length);
+      if (WriteAll(Record.data(), Record.size(), End) == false)
+	 return false;
+
+      auto const I = Index.find(Key);
+      if (I != Index.end())
+	 I->second = End;
+      else
+      {
+	 NewKeys.emplace_back(Key);
+	 Index.emplace(NewKeys.back(), End);
+      }
+      End += Record.size();
+      return true;
+   }
+   bool ForEach(std::function<bool(std::string_view Key, std::string_view Data)> const &Callback) override
+   {
+      for (auto const Offset : SortedOffsets())
+      {
+	 std::string_view Key, Data;
+	 if (ReadRecord(Offset, Key, Data) == false)
+	    return _error->Errno("pread", _("Unable to read %s"), File.c_str());
+	 if (Callback(Key, Data) == false)
+	    return false;
+      }
+      return true;
+   }
+   bool Clean(std::function<bool(std::string_view Key)> const &Keep) override
+   {
+      if (ReadOnly == true)
+	 return true;
+
+      // Write the records to keep into a new file and replace the old one
+      std::string const NewFile = File + ".new";
+      FileFd New(NewFile, FileFd::WriteOnly | FileFd::Create | FileFd::Empty | FileFd::BufferedWrite, 0644);
+      if (New.IsOpen() == false || New.Write(Magic.data(), Magic.size()) == false)
+	 return false;
+      size_t Kept = 0;
+      for (auto const Offset : SortedOffsets())
+      {
+	 std::string_view Key, Data;
+	 if (ReadRecord(Offset, Key, Data) == false)
+	    return _error->Errno("pread", _("Unable to read %s"), File.c_str());
+	 if (Keep(Key) == false)
+	    continue;
+	 RecordHeader const Header{htonl(Key.size()), htonl(Data.size())};
+	 if (New.Write(&Header, sizeof(Header)) == false ||
+	       New.Write(Key.data(), Key.size()) == false ||
+	       New.Write(Data.data(), Data.size()) == false)
+	    return false;
+	 ++Kept;
+      }
+      if (New.Close() == false || Rename(NewFile, File) == false)
+	 return false;
+
+      if(_config->FindB("Debug::APT::FTPArchive::Clean", false) == true)
+	 std::cout << Kept << "\tNumber of unique keys in the log" << std::endl;
+
+      Unload();
+      return Load();
+   }
+
+   LogCacheDB(std::string const &File, bool const ReadOnly) : File(File), ReadOnly(ReadOnly) {}
+   static std::unique_ptr<CacheDBBackend> Open(std::string const &File, bool const ReadOnly)
+   {
+      std::unique_ptr<LogCacheDB> Log(new LogCacheDB(File, ReadOnly));
+      if (Log->Load() == false)
+	 return nullptr;
+      return Log;
+   }
+   ~LogCacheDB() override { Unload(); }
+};
+									/*}}}*/
+// CacheDBBackend::Open - Open a database in the right format		/*{{{*/
+// ---------------------------------------------------------------------
+/* Existing files keep their format, new ones get the configured one */
+std::unique_ptr<CacheDBBackend> CacheDBBackend::Open(std::string const &File, bool const ReadOnly)
+{
+#ifdef HAVE_BDB
+   std::string Format = _config->Find("APT::FTPArchive::CacheDB::Format", "bdb");
+#else
+   std::string Format = _config->Find("APT::FTPArchive::CacheDB::Format", "log");
+#endif
+   struct stat St;
+   if (stat(File.c_str(), &St) == 0 && St.st_size != 0)
+   {
+      std::string Start(LogCacheDB::Magic.size(), '\0');
+      FileFd Existing(File, FileFd::ReadOnly);
+      if (Existing.Read(Start.data(), Start.size()) == false)
+	 return nullptr;
+      Format = (Start == LogCacheDB::Magic) ? "log" : "bdb";
+   }
+
+   if (Format == "log")
+      return LogCacheDB::Open(File, ReadOnly);
+#ifdef HAVE_BDB
+   if (Format == "bdb")
+      return BerkeleyCacheDB::Open(File, ReadOnly);
+#endif
+   _error->Error(_("Unable to open DB file %s: %s"), File.c_str(), ("unsupported format " + Format).c_str());
+   return nullptr;
+}
+									/*}}}*/
+
 CacheDB::CacheDB(std::string const &DB)
-   : Dbp(0), Fd(NULL), DebFile(0)
+   : Dbp(nullptr), Fd(NULL), DebFile(0), Pre(nullptr)
 {
    TmpKey[0]='\0';
    ReadyDB(DB);
@@ -46,58 +438,33 @@ CacheDB::~CacheDB()
 
 // CacheDB::ReadyDB - Ready the DB2					/*{{{*/
 // ---------------------------------------------------------------------
-/* This opens the DB2 file for caching package information */
+/* This opens the DB file for caching package information */
 bool CacheDB::ReadyDB(std::string const &DB)
 {
-   int err;
-
    ReadOnly = _config->FindB("APT::FTPArchive::ReadOnlyDB",false);
    
-   // Close the old DB
-   if (Dbp != 0) 
-      Dbp->close(Dbp,0);
-   
    /* Check if the DB was disabled while running and deal with a 
       corrupted DB */
-   if (DBFailed() == true)
+   bool const Failed = DBFailed();
+
+   // Close the old DB
+   Dbp.reset();
+
+   if (Failed == true)
    {
       _error->Warning(_("DB was corrupted, file renamed to %s.old"),DBFile.c_str());
       rename(DBFile.c_str(),(DBFile+".old").c_str());
    }
    
    DBLoaded = false;
-   Dbp = 0;
    DBFile = std::string();
    
    if (DB.empty())
       return true;
 
-   db_create(&Dbp, NULL, 0);
-   if ((err = Dbp->open(Dbp, NULL, DB.c_str(), NULL, DB_BTREE,
-                        (ReadOnly?DB_RDONLY:DB_CREATE),
-                        0644)) != 0)
-   {
-      if (err == DB_OLD_VERSION)
-      {
-          _error->Warning(_("DB is old, attempting to upgrade %s"),DBFile.c_str());
-	  err = Dbp->upgrade(Dbp, DB.c_str(), 0);
-	  if (!err)
-	     err = Dbp->open(Dbp, NULL, DB.c_str(), NULL, DB_HASH,
-                            (ReadOnly?DB_RDONLY:DB_CREATE), 0644);
-
-      }
-      // the database format has changed from DB_HASH to DB_BTREE in 
-      // apt 0.6.44
-      if (err == EINVAL)
-      {
-	 _error->Error(_("DB format is invalid. If you upgraded from an older version of apt, please remove and re-create the database."));
-      }
-      if (err)
-      {
-          Dbp = 0;
-          return _error->Error(_("Unable to open DB file %s: %s"),DB.c_str(), db_strerror(err));
-      }
-   }
+   Dbp = CacheDBBackend::Open(DB, ReadOnly);
+   if (Dbp == nullptr)
+      return false;
 
    DBFile = DB;
    DBLoaded = true;
@@ -187,41 +554,21 @@ bool CacheDB::GetFileStat(bool const &doStat)
    return true;
 }
 									/*}}}*/
-// CacheDB::GetCurStatCompatOldFormat           			/*{{{*/
-// ---------------------------------------------------------------------
-/* Read the old (32bit FileSize) StateStore format from disk */
-bool CacheDB::GetCurStatCompatOldFormat()
+// CacheDB::Get - Look up the current key				/*{{{*/
+bool CacheDB::Get()
 {
-   InitQueryStats();
-   Data.data = &CurStatOldFormat;
-   Data.flags = DB_DBT_USERMEM;
-   Data.ulen = sizeof(CurStatOldFormat);
-   if (Get() == false)
-   {
-      CurStat.Flags = 0;
-   } else {
-      CurStat.Flags = CurStatOldFormat.Flags;
-      CurStat.mtime = CurStatOldFormat.mtime;
-      CurStat.FileSize = CurStatOldFormat.FileSize;
-      memcpy(CurStat.MD5, CurStatOldFormat.MD5, sizeof(CurStat.MD5));
-      memcpy(CurStat.SHA1, CurStatOldFormat.SHA1, sizeof(CurStat.SHA1));
-      memcpy(CurStat.SHA256, CurStatOldFormat.SHA256, sizeof(CurStat.SHA256));
-   }
-   return true;
+   return Dbp->Get(TmpKey, Data);
 }
 									/*}}}*/
-// CacheDB::GetCurStatCompatOldFormat           			/*{{{*/
-// ---------------------------------------------------------------------
-/* Read the new (64bit FileSize) StateStore format from disk */
-bool CacheDB::GetCurStatCompatNewFormat()
+// CacheDB::Put - Store data for the current key			/*{{{*/
+bool CacheDB::Put(const void *In,unsigned long const &Length)
 {
-   InitQueryStats();
-   Data.data = &CurStat;
-   Data.flags = DB_DBT_USERMEM;
-   Data.ulen = sizeof(CurStat);
-   if (Get() == false)
+   if (ReadOnly == true)
+      return true;
+   if (DBLoaded == true && Dbp->Put(TmpKey, In, Length) == false)
    {
-      CurStat.Flags = 0;
+      DBLoaded = false;
+      return false;
    }
    return true;
 }
@@ -236,27 +583,27 @@ bool CacheDB::GetCurStat()
    
    if (DBLoaded)
    {
-      // do a first query to just get the size of the data on disk
       InitQueryStats();
-      Data.data = &CurStat;
-      Data.flags = DB_DBT_USERMEM;
-      Data.ulen = 0;
-      Get();
-
-      if (Data.size == 0)
+      if (Get() == false || Data.empty())
       {
          // nothing needs to be done, we just have not data for this deb
       }
       // check if the record is written in the old format (32bit filesize)
-      else if(Data.size == sizeof(CurStatOldFormat))
+      else if(Data.size() == sizeof(CurStatOldFormat))
       {
-         GetCurStatCompatOldFormat();
+	 memcpy(&CurStatOldFormat, Data.data(), sizeof(CurStatOldFormat));
+	 CurStat.Flags = CurStatOldFormat.Flags;
+	 CurStat.mtime = CurStatOldFormat.mtime;
+	 CurStat.FileSize = CurStatOldFormat.FileSize;
+	 memcpy(CurStat.MD5, CurStatOldFormat.MD5, sizeof(CurStat.MD5));
+	 memcpy(CurStat.SHA1, CurStatOldFormat.SHA1, sizeof(CurStat.SHA1));
+	 memcpy(CurStat.SHA256, CurStatOldFormat.SHA256, sizeof(CurStat.SHA256));
       }
-      else if(Data.size == sizeof(CurStat))
+      else if(Data.size() == sizeof(CurStat))
       {
-         GetCurStatCompatNewFormat();
+	 memcpy(&CurStat, Data.data(), sizeof(CurStat));
       } else {
-         return _error->Error("Cache record size mismatch (%ul)", Data.size);
+         return _error->Error("Cache record size mismatch (%zu)", Data.size());
       }
 
       CurStat.Flags = ntohl(CurStat.Flags);
@@ -306,7 +653,7 @@ bool CacheDB::LoadSource()						/*{{{*/
    {
       // Lookup the control information
       InitQuerySource();
-      if (Get() == true && Dsc.TakeDsc(Data.data, Data.size) == true)
+      if (Get() == true && Dsc.TakeDsc(Data.data(), Data.size()) == true)
       {
 	    return true;
       }
@@ -340,17 +687,26 @@ bool CacheDB::LoadControl()
    {
       // Lookup the control information
       InitQueryControl();
-      if (Get() == true && Control.TakeControl(Data.data,Data.size) == true)
+      if (Get() == true && Control.TakeControl(Data.data(),Data.size()) == true)
 	    return true;
       CurStat.Flags &= ~FlControl;
    }
    
-   if(OpenDebFile() == false)
-      return false;
-   
-   Stats.Misses++;
-   if (Control.Read(*DebFile) == false)
-      return false;
+   if (UsePrefetch() && Pre->DoControl)
+   {
+      Stats.Misses++;
+      if (Control.TakeControl(Pre->Control.Control, Pre->Control.Length) == false)
+	 return _error->Error(_("Unparsable control file"));
+   }
+   else
+   {
+      if(OpenDebFile() == false)
+	 return false;
+
+      Stats.Misses++;
+      if (Control.Read(*DebFile) == false)
+	 return false;
+   }
 
    if (Control.Control == 0)
       return _error->Error(_("Archive has no control record"));
@@ -377,19 +733,28 @@ bool CacheDB::LoadContents(bool const &GenOnly)
       InitQueryContent();
       if (Get() == true)
       {
-	 if (Contents.TakeContents(Data.data,Data.size) == true)
+	 if (Contents.TakeContents(Data.data(),Data.size()) == true)
 	    return true;
       }
       
       CurStat.Flags &= ~FlContents;
    }
    
-   if(OpenDebFile() == false)
-      return false;
+   if (UsePrefetch() && Pre->DoContents)
+   {
+      Stats.Misses++;
+      if (Contents.TakeContents(Pre->Contents.Data, Pre->Contents.CurSize) == false)
+	 return false;
+   }
+   else
+   {
+      if(OpenDebFile() == false)
+	 return false;
 
-   Stats.Misses++;
-   if (Contents.Read(*DebFile) == false)
-      return false;	    
+      Stats.Misses++;
+      if (Contents.Read(*DebFile) == false)
+	 return false;
+   }
    
    // Write back the control information
    InitQueryContent();
@@ -428,38 +793,48 @@ static void hex2bytes(uint8_t *bytes, const char *hex, int length) {
       bytes++;
    } 
 }
-bool CacheDB::GetHashes(bool const GenOnly, unsigned int const DoHashes)
+unsigned int CacheDB::NotCachedHashes(uint32_t const Flags)
 {
    unsigned int notCachedHashes = 0;
-   if ((CurStat.Flags & FlMD5) != FlMD5)
+   if ((Flags & FlMD5) != FlMD5)
    {
       notCachedHashes = notCachedHashes | Hashes::MD5SUM;
    }
-   if ((CurStat.Flags & FlSHA1) != FlSHA1)
+   if ((Flags & FlSHA1) != FlSHA1)
    {
       notCachedHashes = notCachedHashes | Hashes::SHA1SUM;
    }
-   if ((CurStat.Flags & FlSHA256) != FlSHA256)
+   if ((Flags & FlSHA256) != FlSHA256)
    {
       notCachedHashes = notCachedHashes | Hashes::SHA256SUM;
    }
-   if ((CurStat.Flags & FlSHA512) != FlSHA512)
+   if ((Flags & FlSHA512) != FlSHA512)
    {
       notCachedHashes = notCachedHashes | Hashes::SHA512SUM;
    }
-   unsigned int FlHashes = DoHashes & notCachedHashes;
+   return notCachedHashes;
+}
+bool CacheDB::GetHashes(bool const GenOnly, unsigned int const DoHashes)
+{
+   unsigned int FlHashes = DoHashes & NotCachedHashes(CurStat.Flags);
    HashesList.clear();
 
    if (FlHashes != 0)
    {
-      if (OpenFile() == false)
-	 return false;
+      HashStringList hl;
+      if (UsePrefetch() && (Pre->DoHashes & FlHashes) == FlHashes)
+	 hl = Pre->HashesList;
+      else
+      {
+	 if (OpenFile() == false)
+	    return false;
 
-      Hashes hashes(FlHashes);
-      if (Fd->Seek(0) == false || hashes.AddFD(*Fd, CurStat.FileSize) == false)
-	 return false;
+	 Hashes hashes(FlHashes);
+	 if (Fd->Seek(0) == false || hashes.AddFD(*Fd, CurStat.FileSize) == false)
+	    return false;
 
-      HashStringList hl = hashes.GetHashStringList();
+	 hl = hashes.GetHashStringList();
+      }
       for (HashStringList::const_iterator hs = hl.begin(); hs != hl.end(); ++hs)
       {
 	 HashesList.push_back(*hs);
@@ -509,6 +884,66 @@ bool CacheDB::GetHashes(bool const GenOnly, unsigned int const DoHashes)
    return ret;
 }
 									/*}}}*/
+// CacheDB::PlanPrefetch - Check what isn't cached for a file		/*{{{*/
+// ---------------------------------------------------------------------
+/* This only reads the database, the state of the current file is kept
+   intact so it can be called between GetFileInfo and Finish. */
+std::unique_ptr<CacheDB::Prefetch> CacheDB::PlanPrefetch(std::string const &File,
+      bool const DoControl, bool const DoContents, unsigned int const DoHashes,
+      bool const checkMtime)
+{
+   std::string const SavedFileName = FileName;
+   StatStore const SavedStat = CurStat;
+   FileName = File;
+   // GetFileInfo reports problems with the record itself later on
+   _error->PushToStack();
+   uint32_t Flags = GetCurStat() ? CurStat.Flags : 0;
+   _error->RevertToStack();
+   uint32_t const mtime = CurStat.mtime;
+   FileName = SavedFileName;
+   CurStat = SavedStat;
+
+   if (checkMtime == true && (Flags & FlSize) == FlSize)
+   {
+      struct stat St;
+      if (stat(File.c_str(), &St) != 0 || htonl(St.st_mtime) != mtime)
+	 Flags = 0;
+   }
+
+   bool const NeedControl = DoControl && (Flags & FlControl) != FlControl;
+   bool const NeedContents = DoContents && (Flags & FlContents) != FlContents;
+   unsigned int const NeedHashes = DoHashes & NotCachedHashes(Flags);
+   if (NeedControl == false && NeedContents == false && NeedHashes == 0)
+      return nullptr;
+   return std::make_unique<Prefetch>(File, NeedControl, NeedContents, NeedHashes);
+}
+									/*}}}*/
+// CacheDB::Prefetch::Run - Do the work on the file itself		/*{{{*/
+bool CacheDB::Prefetch::Run()
+{
+   FileFd Fd(FileName, FileFd::ReadOnly);
+   if (Fd.IsOpen() == false || fstat(Fd.Fd(), &St) != 0)
+      return false;
+
+   if (DoControl || DoContents)
+   {
+      debDebFile Deb(Fd);
+      if (_error->PendingError() == true ||
+	    (DoControl && (Control.Read(Deb) == false || Control.Control == nullptr)) ||
+	    (DoContents && Contents.Read(Deb) == false))
+	 return false;
+   }
+
+   if (DoHashes != 0)
+   {
+      Hashes hashes(DoHashes);
+      if (Fd.Seek(0) == false || hashes.AddFD(Fd, St.st_size) == false)
+	 return false;
+      HashesList = hashes.GetHashStringList();
+   }
+   return true;
+}
+									/*}}}*/
 // CacheDB::Finish - Write back the cache structure			/*{{{*/
 // ---------------------------------------------------------------------
 /* */
@@ -538,42 +973,32 @@ bool CacheDB::Clean()
    if (DBLoaded == false)
       return true;
 
-   /* I'm not sure what VERSION_MINOR should be here.. 2.4.14 certainly
-      needs the lower one and 2.7.7 needs the upper.. */
-   DBC *Cursor;
-   if ((errno = Dbp->cursor(Dbp, NULL, &Cursor, 0)) != 0)
-      return _error->Error(_("Unable to get a cursor"));
-   
-   DBT Key;
-   DBT Data;
-   memset(&Key,0,sizeof(Key));
-   memset(&Data,0,sizeof(Data));
-   while ((errno = Cursor->c_get(Cursor,&Key,&Data,DB_NEXT)) == 0)
-   {
-      const char *Colon = (char*)memrchr(Key.data, ':', Key.size);
-      if (Colon)
-      {
-         if (stringcmp(Colon + 1, (char *)Key.data+Key.size,"st") == 0 ||
-             stringcmp(Colon + 1, (char *)Key.data+Key.size,"cl") == 0 ||
-             stringcmp(Colon + 1, (char *)Key.data+Key.size,"cs") == 0 ||
-             stringcmp(Colon + 1, (char *)Key.data+Key.size,"cn") == 0)
-	 {
-            std::string FileName = std::string((const char *)Key.data,Colon);
-            if (FileExists(FileName) == true) {
-		continue;
-            }
-	 }
-      }
-      Cursor->c_del(Cursor,0);
-   }
-   int res = Dbp->compact(Dbp, NULL, NULL, NULL, NULL, DB_FREE_SPACE, NULL);
-   if (res < 0)
-      _error->Warning("compact failed with result %i", res);
-
-   if(_config->FindB("Debug::APT::FTPArchive::Clean", false) == true)
-      Dbp->stat_print(Dbp, 0);
-
-
-   return true;
+   return Dbp->Clean([](std::string_view const Key) {
+      auto const Colon = Key.rfind(':');
+      if (Colon == std::string_view::npos)
+	 return false;
+      auto const Type = Key.substr(Colon + 1);
+      if (Type != "st" && Type != "cl" && Type != "cs" && Type != "cn")
+	 return false;
+      return FileExists(std::string{Key.substr(0, Colon)});
+   });
+}
+									/*}}}*/
+// CacheDB::Convert - Convert a database into the log format		/*{{{*/
+bool CacheDB::Convert(std::string const &From, std::string const &To)
+{
+   if (FileExists(To) == true)
+      return _error->Error(_("File %s already exists"), To.c_str());
+   auto const Old = CacheDBBackend::Open(From, true);
+   if (Old == nullptr)
+      return false;
+   auto const New = LogCacheDB::Open(To, false);
+   if (New == nullptr)
+      return false;
+   return Old->ForEach([&](std::string_view const Key, std::string_view const Data) {
+      if (New->Put(Key, Data.data(), Data.size()) == true)
+	 return true;
+      return _error->Errno("write", _("Unable to write to %s"), To.c_str());
+   });
 }
 									/*}}}*/
@@ -14,28 +14,30 @@
 #include <apt-pkg/debfile.h>
 #include <apt-pkg/hashes.h>
 
-#include <db.h>
 #include <cerrno>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <netinet/in.h>
+#include <sys/stat.h>
 
 #include "contents.h"
 #include "sources.h"
 
 class FileFd;
-
+class CacheDBBackend;
 
 class CacheDB
 {
    protected:
       
    // Database state/access
-   DBT Key;
-   DBT Data;
    std::string TmpKey;
-   DB *Dbp;
+   std::string_view Data;
+   std::unique_ptr<CacheDBBackend> Dbp;
    bool DBLoaded;
    bool ReadOnly;
    std::string DBFile;
@@ -43,11 +45,8 @@ class CacheDB
    // Generate a key for the DB of a given type
    void _InitQuery(const char *Type)
    {
-      memset(&Key,0,sizeof(Key));
-      memset(&Data,0,sizeof(Data));
+      Data = {};
       TmpKey.assign(FileName).append(":").append(Type);
-      Key.data = TmpKey.data();
-      Key.size = TmpKey.size();
    }
    
    void InitQueryStats() {
@@ -63,23 +62,8 @@ class CacheDB
       _InitQuery("cn");
    }
 
-   inline bool Get() 
-   {
-      return Dbp->get(Dbp,0,&Key,&Data,0) == 0;
-   };
-   inline bool Put(const void *In,unsigned long const &Length) 
-   {
-      if (ReadOnly == true)
-	 return true;
-      Data.size = Length;
-      Data.data = (void *)In;
-      if (DBLoaded == true && (errno = Dbp->put(Dbp,0,&Key,&Data,0)) != 0)
-      {
-	 DBLoaded = false;
-	 return false;
-      }
-      return true;
-   }
+   bool Get();
+   bool Put(const void *In,unsigned long const &Length);
    bool OpenFile();
    void CloseFile();
 
@@ -87,14 +71,13 @@ class CacheDB
    void CloseDebFile();
 
    // GetCurStat needs some compat code, see lp #1274466)
-   bool GetCurStatCompatOldFormat();
-   bool GetCurStatCompatNewFormat();
    bool GetCurStat();
 
    bool GetFileStat(bool const &doStat = false);
    bool LoadControl();
    bool LoadContents(bool const &GenOnly);
    bool LoadSource();
+   static unsigned int NotCachedHashes(uint32_t const Flags);
    bool GetHashes(bool const GenOnly, unsigned int const DoHashes);
 
    // Stat info stored in the DB, Fixed types since it is written to disk.
@@ -133,6 +116,39 @@ class CacheDB
    std::string FileName;
    FileFd *Fd;
    debDebFile *DebFile;
+
+   public:
+   // Database independent work on a file which can be done ahead of time
+   struct Prefetch
+   {
+      std::string FileName;
+      bool DoControl;
+      bool DoContents;
+      unsigned int DoHashes;
+      bool Failed;
+
+      struct stat St;
+      debDebFile::MemControlExtract Control;
+      ContentsExtract Contents;
+      HashStringList HashesList;
+
+      /* Can be called from any thread. Errors are left in the _error of
+	 that thread, set Failed instead to let GetFileInfo redo the work */
+      bool Run();
+
+      Prefetch(std::string const &FileName, bool const DoControl, bool const DoContents,
+	    unsigned int const DoHashes) : FileName(FileName), DoControl(DoControl),
+	 DoContents(DoContents), DoHashes(DoHashes), Failed(false), St() {};
+   };
+
+   protected:
+   Prefetch const *Pre;
+   bool UsePrefetch() const
+   {
+      return Pre != nullptr && Pre->Failed == false && Pre->FileName == FileName &&
+	 static_cast<unsigned long long>(Pre->St.st_size) == CurStat.FileSize &&
+	 htonl(Pre->St.st_mtime) == CurStat.mtime;
+   }
    
    public:
 
@@ -169,7 +185,7 @@ class CacheDB
    } Stats;
    
    bool ReadyDB(std::string const &DB = "");
-   inline bool DBFailed() {return Dbp != 0 && DBLoaded == false;};
+   inline bool DBFailed() {return Dbp != nullptr && DBLoaded == false;};
    inline bool Loaded() {return DBLoaded == true;};
    
    inline unsigned long long GetFileSize(void) {return CurStat.FileSize;}
@@ -185,9 +201,21 @@ class CacheDB
 	 unsigned int const DoHashes,
 	 bool const &checkMtime = false);
 
+   /* Returns the work GetFileInfo would need to do on the file itself
+      or nullptr if the database has everything cached already */
+   std::unique_ptr<Prefetch> PlanPrefetch(std::string const &FileName,
+	 bool const DoControl,
+	 bool const DoContents,
+	 unsigned int const DoHashes,
+	 bool const checkMtime = false);
+   // Use the results of a Prefetch in the next GetFileInfo call
+   void SetPrefetch(Prefetch const * const P) {Pre = P;};
+
    bool Finish();   
    
    bool Clean();
+   // Copy all records of a database into a new one in the log format
+   static bool Convert(std::string const &From, std::string const &To);
    
    explicit CacheDB(std::string const &DB);
    ~CacheDB();
@@ -6,39 +6,141 @@
 
    The GenContents class is a back end for an archive contents generator.
    It takes a list of per-deb file name and merges it into a memory
-   database of all previous output. This database is stored as a set of
-   pairs (path, package).
+   database of all previous output. This database is stored as a flat
+   list of pairs (path, package), which is sorted before it is printed.
 
    This may be very inefficient since it does duplicate all path components,
    whereas most are shared. A previous implementation used a tree structure
    with a binary tree for entries in a directory, which was significantly
    more space-efficient but it did not do rebalancing and implementing custom
-   self-balancing trees here seems a waste of effort.
+   self-balancing trees here seems a waste of effort. Instead, if the list
+   grows too large it is sorted and written to a temporary file and all
+   of these runs are merged while printing.
 
    ##################################################################### */
 									/*}}}*/
 // Include Files							/*{{{*/
 #include <config.h>
 
+#include <apt-pkg/configuration.h>
 #include <apt-pkg/debfile.h>
 #include <apt-pkg/dirstream.h>
 #include <apt-pkg/error.h>
 #include <apt-pkg/fileutl.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
 
 #include "contents.h"
 
 #include <apti18n.h>
 									/*}}}*/
 
+// GenContents::Run - A sorted run of entries in a temporary file	/*{{{*/
+// ---------------------------------------------------------------------
+/* Entries are stored as pairs of zero-terminated strings and read back
+   one by one through a buffer. */
+class GenContents::Run
+{
+   static constexpr size_t BufferSize = 1024 * 1024;
+
+   std::unique_ptr<FileFd> File;
+   std::vector<char> Buffer;
+   size_t Start = 0;
+   size_t End = 0;
+   bool Eof = false;
+
+   public:
+   const char *Path = nullptr;
+   const char *Package = nullptr;
+
+   bool Write(std::vector<Entry> const &Entries)
+   {
+      std::string Out;
+      Out.reserve(BufferSize + 4096);
+      for (auto const &E : Entries)
+      {
+	 Out.append(E.first.c_str()).append(1, '\0');
+	 Out.append(E.second.c_str()).append(1, '\0');
+	 if (Out.size() >= BufferSize)
+	 {
+	    if (File->Write(Out.data(), Out.size()) == false)
+	       return false;
+	    Out.clear();
+	 }
+      }
+      return File->Write(Out.data(), Out.size()) && File->Seek(0);
+   }
+   // Moves to the next entry, returns false at the end of the run
+   bool Next()
+   {
+      // only allocated once the run is merged
+      if (Buffer.empty())
+	 Buffer.resize(BufferSize);
+      while (true)
+      {
+	 auto const Begin = Buffer.data() + Start;
+	 auto const Stop = Buffer.data() + End;
+	 auto const PathEnd = static_cast<char *>(memchr(Begin, '\0', Stop - Begin));
+	 if (PathEnd != nullptr)
+	 {
+	    auto const PackageEnd = static_cast<char *>(memchr(PathEnd + 1, '\0', Stop - PathEnd - 1));
+	    if (PackageEnd != nullptr)
+	    {
+	       Path = Begin;
+	       Package = PathEnd + 1;
+	       Start = PackageEnd + 1 - Buffer.data();
+	       return true;
+	    }
+	 }
+	 if (Eof)
+	 {
+	    if (Start != End)
+	       _error->Error("Temporary contents file %s is truncated", File->Name().c_str());
+	    return false;
+	 }
+
+	 // Move the incomplete entry to the front and refill the buffer
+	 memmove(Buffer.data(), Begin, End - Start);
+	 End -= Start;
+	 Start = 0;
+	 if (End == Buffer.size())
+	    Buffer.resize(Buffer.size() * 2);
+	 unsigned long long Actual = 0;
+	 if (File->Read(Buffer.data() + End, Buffer.size() - End, &Actual) == false)
+	    return false;
+	 End += Actual;
+	 Eof = Actual == 0;
+      }
+   }
+
+   explicit Run(FileFd * const File) : File(File) {}
+};
+									/*}}}*/
+// GenContents::GenContents - Constructor				/*{{{*/
+GenContents::GenContents()
+{
+   // in MiB
+   auto const Limit = _config->FindI("APT::FTPArchive::Contents::MemoryLimit", 1024);
+   if (Limit <= 0)
+      MemoryLimit = std::numeric_limits<decltype(MemoryLimit)>::max();
+   else
+      MemoryLimit = Limit * 1024ull * 1024;
+}
+									/*}}}*/
 // GenContents::~GenContents - Free allocated memory			/*{{{*/
+GenContents::~GenContents()
+{
+}
+									/*}}}*/
+// GenContents::StringPool::Clear - Free allocated memory		/*{{{*/
 // ---------------------------------------------------------------------
 /* Since all our allocations are static big-block allocations all that is 
    needed is to free all of them. */
-GenContents::~GenContents()
+void GenContents::StringPool::Clear()
 {
    while (BlockList != 0)
    {
@@ -47,13 +149,16 @@ GenContents::~GenContents()
       free(Old->Block);
       delete Old;
    }   
+   StrPool = nullptr;
+   StrLeft = 0;
+   Allocated = 0;
 }
 									/*}}}*/
-// GenContents::Mystrdup - Custom strdup				/*{{{*/
+// GenContents::StringPool::Strdup - Custom strdup			/*{{{*/
 // ---------------------------------------------------------------------
 /* This strdup also uses a large block allocator to eliminate glibc
    overhead */
-GenContents::StringInBlock GenContents::Mystrdup(const char *From)
+GenContents::StringInBlock GenContents::StringPool::Strdup(const char *From)
 {
    unsigned int Len = strlen(From) + 1;
    if (StrLeft <= Len)
@@ -62,6 +167,7 @@ GenContents::StringInBlock GenContents::Mystrdup(const char *From)
       if (unlikely(StrLeft <= Len))
 	 abort();
       StrPool = (char *)malloc(StrLeft);
+      Allocated += StrLeft;
       
       BigBlock *Block = new BigBlock;
       Block->Block = StrPool;
@@ -93,7 +199,37 @@ void GenContents::Add(const char *Dir, StringInBlock Package)
 
    // We used to add all parents directories here too, but we never printed
    // them, so just add the file directly.
-   Entries.emplace(Mystrdup(Dir), Package);
+   Entries.emplace_back(Paths.Strdup(Dir), Package);
+   if (Paths.Allocated - Paths.StrLeft + Entries.size() * sizeof(Entry) > MemoryLimit && SpillEntries() == false)
+   {
+      // keep going in memory rather than failing on each entry
+      MemoryLimit = std::numeric_limits<decltype(MemoryLimit)>::max();
+   }
+}
+									/*}}}*/
+// GenContents::SortEntries - Sort and deduplicate the entries		/*{{{*/
+void GenContents::SortEntries()
+{
+   std::sort(Entries.begin(), Entries.end());
+   Entries.erase(std::unique(Entries.begin(), Entries.end(), [](Entry const &a, Entry const &b) {
+      return strcmp(a.first.c_str(), b.first.c_str()) == 0 && strcmp(a.second.c_str(), b.second.c_str()) == 0;
+   }), Entries.end());
+}
+									/*}}}*/
+// GenContents::SpillEntries - Write the entries out as a sorted run	/*{{{*/
+bool GenContents::SpillEntries()
+{
+   SortEntries();
+   FileFd * const Tmp = GetTempFile("apt-ftparchive-contents");
+   if (Tmp == nullptr)
+      return false;
+   auto R = std::make_unique<Run>(Tmp);
+   if (R->Write(Entries) == false)
+      return false;
+   Runs.push_back(std::move(R));
+   Entries.clear();
+   Paths.Clear();
+   return true;
 }
 									/*}}}*/
 // GenContents::WriteSpace - Write a given number of white space chars	/*{{{*/
@@ -116,42 +252,100 @@ void GenContents::WriteSpace(std::string &out, size_t Current, size_t Target)
 									/*}}}*/
 // GenContents::Print - Display the tree				/*{{{*/
 // ---------------------------------------------------------------------
-/* This is the final result function. It takes the tree and recursively
-   calls itself and runs over each section of the tree printing out
-   the pathname and the hit packages. We use Buf to build the pathname
-   summed over all the directory parents of this node. */
+/* This is the final result function. It takes the sorted entries either
+   directly or by merging the runs and prints out the pathname and the
+   hit packages. Runs may contain the same entries, so those are skipped. */
 void GenContents::Print(FileFd &Out)
 {
-   const char *last = nullptr;
+   std::string last;
+   std::string lastPackage;
+   bool seenFile = false;
    std::string line;
-   for (auto &entry : Entries)
-   {
+   auto const PrintEntry = [&](const char *Path, const char *Package) {
       // Do not show the item if it is a directory
-      if (not APT::String::Endswith(entry.first.c_str(), "/"))
+      if (APT::String::Endswith(Path, "/"))
+	 return;
+      // We are still appending to the same file path
+      if (seenFile && last == Path)
       {
-	 // We are still appending to the same file path
-	 if (last != nullptr && strcmp(entry.first.c_str(), last) == 0)
-	 {
-	    line.append(",");
-	    line.append(entry.second.c_str());
-	    continue;
-	 }
-	 // New file. If we saw a file before, write out its line
-	 if (last != nullptr)
+	 if (lastPackage == Package)
+	    return;
+	 line.append(",");
+	 line.append(Package);
+	 lastPackage = Package;
+	 return;
+      }
+      // New file. If we saw a file before, write out its line
+      if (seenFile)
+      {
+	 line.append("\n", 1);
+	 Out.Write(line.data(), line.length());
+      }
+
+      // Append the package name, tab(s), and first to the line
+      line.assign(Path);
+      WriteSpace(line, line.length(), 60);
+      line.append(Package);
+      last = Path;
+      lastPackage = Package;
+      seenFile = true;
+   };
+
+   if (Runs.empty())
+   {
+      SortEntries();
+      for (auto &entry : Entries)
+	 PrintEntry(entry.first.c_str(), entry.second.c_str());
+   }
+   else
+   {
+      // The last entries are spilled as well, but if that fails they are
+      // merged from memory instead, SpillEntries has sorted them anyhow.
+      if (Entries.empty() == false && SpillEntries() == false)
+	 _error->Warning("Merging the remaining contents entries in memory");
+
+      // k-way merge of all runs with a heap of the current entries
+      auto const Greater = [](Run const *a, Run const *b) {
+	 int const res = strcmp(a->Path, b->Path);
+	 return res > 0 || (res == 0 && strcmp(a->Package, b->Package) > 0);
+      };
+      std::vector<Run *> Heap;
+      for (auto &R : Runs)
+	 if (R->Next())
+	    Heap.push_back(R.get());
+      std::make_heap(Heap.begin(), Heap.end(), Greater);
+      auto Mem = Entries.cbegin();
+      while (Heap.empty() == false || Mem != Entries.cend())
+      {
+	 if (Mem != Entries.cend())
 	 {
-	    line.append("\n", 1);
-	    Out.Write(line.data(), line.length());
+	    int res = 1;
+	    if (Heap.empty() == false)
+	    {
+	       res = strcmp(Heap.front()->Path, Mem->first.c_str());
+	       if (res == 0)
+		  res = strcmp(Heap.front()->Package, Mem->second.c_str());
+	    }
+	    if (res > 0)
+	    {
+	       PrintEntry(Mem->first.c_str(), Mem->second.c_str());
+	       ++Mem;
+	       continue;
+	    }
 	 }
-
-	 // Append the package name, tab(s), and first to the line
-	 line.assign(entry.first.c_str());
-	 WriteSpace(line, line.length(), 60);
-	 line.append(entry.second.c_str());
-	 last = entry.first.c_str();
+	 std::pop_heap(Heap.begin(), Heap.end(), Greater);
+	 Run * const R = Heap.back();
+	 PrintEntry(R->Path, R->Package);
+	 if (R->Next())
+	    std::push_heap(Heap.begin(), Heap.end(), Greater);
+	 else
+	    Heap.pop_back();
       }
+      Runs.clear();
    }
+
    // Print the trailing line
-   if (last != nullptr)
+   if (seenFile)
    {
       line.append("\n", 1);
       Out.Write(line.c_str(), line.length());
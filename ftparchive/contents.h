@@ -14,8 +14,10 @@
 
 #include <cstddef>
 #include <cstdio>
-#include <set>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 class debDebFile;
 class FileFd;
@@ -34,22 +36,39 @@ class GenContents
       void *Block;
       BigBlock *Next;
    };
+   /// \brief Big block allocation pool
+   struct StringPool
+   {
+      BigBlock *BlockList = nullptr;
+      char *StrPool = nullptr;
+      unsigned long StrLeft = 0;
+      unsigned long long Allocated = 0;
 
-   std::set<std::pair<StringInBlock, StringInBlock>> Entries;
+      StringInBlock Strdup(const char *From);
+      void Clear();
+      ~StringPool() { Clear(); };
+   };
+   using Entry = std::pair<StringInBlock, StringInBlock>;
+   class Run;
 
-   // Big block allocation pools
-   BigBlock *BlockList;   
-   char *StrPool;
-   unsigned long StrLeft;
+   /* Entries are collected unsorted and sorted into runs, which are
+      written to temporary files if they exceed the memory limit. */
+   std::vector<Entry> Entries;
+   std::vector<std::unique_ptr<Run>> Runs;
+   StringPool Packages;
+   StringPool Paths;
+   unsigned long long MemoryLimit;
 
+   void SortEntries();
+   bool SpillEntries();
    void WriteSpace(std::string &out, size_t Current, size_t Target);
 
    public:
-   StringInBlock Mystrdup(const char *From);
+   StringInBlock Mystrdup(const char *From) { return Packages.Strdup(From); };
    void Add(const char *Dir, StringInBlock Package);
    void Print(FileFd &Out);
 
-   GenContents() : BlockList(0), StrPool(0), StrLeft(0) {};
+   GenContents();
    ~GenContents();
 };
 
@@ -6,9 +6,9 @@
 
    This class is very complicated in order to optimize for the common
    case of its use, writing a large set of compressed files that are 
-   different from the old set. It spawns off compressors in parallel
-   to maximize compression throughput and has a separate task managing
-   the data going into the compressors.
+   different from the old set. It has a separate task managing the data
+   going into the compressors, which feeds each of them from its own
+   thread to maximize compression throughput.
    
    ##################################################################### */
 									/*}}}*/
@@ -23,6 +23,11 @@
 
 #include <array>
 #include <cctype>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <system_error>
+#include <thread>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -253,47 +258,45 @@ bool MultiCompress::OpenOld(FileFd &Fd)
    return Fd.Open(Best->Output, FileFd::ReadOnly, FileFd::Extension);
 }
 									/*}}}*/
-// MultiCompress::Child - The writer child				/*{{{*/
+// OldFileHash - Hash the uncompressed content of an old file		/*{{{*/
 // ---------------------------------------------------------------------
-/* The child process forks a bunch of compression children and takes 
-   input on FD and passes it to all the compressor child. On the way it
-   computes the MD5 of the raw data. After this the raw data in the 
-   original files is compared to see if this data is new. If the data
-   is new then the temp files are renamed, otherwise they are erased. */
-bool MultiCompress::Child(int const &FD)
+/* Runs on its own thread, so failures are only reported by returning an
+   empty hash; the files are considered changed then. */
+static std::pair<std::string, unsigned long long> OldFileHash(FileFd &CompFd)
 {
-   /* Okay, now we just feed data from FD to all the other FDs. Also
-      stash a hash of the data to use later. */
-   SetNonBlock(FD,false);
    std::array<unsigned char, APT_BUFFER_SIZE> Buffer;
+   Hashes OldMD5(Hashes::MD5SUM);
    unsigned long long FileSize = 0;
-   Hashes MD5(Hashes::MD5SUM);
    while (1)
    {
-      WaitFd(FD,false);
-      int Res = read(FD,Buffer.data(),Buffer.size());
+      unsigned long long Res = 0;
+      if (CompFd.Read(Buffer.data(),Buffer.size(), &Res) == false)
+      {
+	 _error->Discard();
+	 return {};
+      }
       if (Res == 0)
 	 break;
-      if (Res < 0)
-	 continue;
-
-      MD5.Add(Buffer.data(),Res);
       FileSize += Res;
-      for (Files *I = Outputs; I != 0; I = I->Next)
-      {
-	 if (I->TmpFile.Write(Buffer.data(), Res) == false)
-	 {
-	    _error->Errno("write",_("IO to subprocess/file failed"));
-	    break;
-	 }
-      }      
-   }   
-
-   if (_error->PendingError() == true)
-      return false;
-   
-   /* Now we have to copy the files over, or erase them if they
-      have not changed. First find the cheapest decompressor */
+      OldMD5.Add(Buffer.data(),Res);
+   }
+   CompFd.Close();
+   _error->Discard();
+   return {OldMD5.GetHashString(Hashes::MD5SUM).HashValue(), FileSize};
+}
+									/*}}}*/
+// MultiCompress::Child - The writer child				/*{{{*/
+// ---------------------------------------------------------------------
+/* The child process starts a thread for each compressed output, takes
+   input on FD and passes it to all the compressor threads through a
+   small ring of buffers. On the way it computes the MD5 of the raw data.
+   Meanwhile the raw data in the original files is hashed by another
+   thread to see if this data is new. If the data is new then the temp
+   files are renamed, otherwise they are erased. */
+bool MultiCompress::Child(int const &FD)
+{
+   /* Look at the old files while the new ones are written. Use the one
+      with the cheapest decompressor if they all exist. */
    bool Missing = false;
    for (Files *I = Outputs; I != 0; I = I->Next)
    {
@@ -303,44 +306,155 @@ bool MultiCompress::Child(int const &FD)
 	 break;
       }            
    }
-   
-   // Check the MD5 of the lowest cost entity.
-   while (Missing == false)
+   FileFd CompFd;
+   std::pair<std::string, unsigned long long> OldHash;
+   std::thread OldHasher;
+   if (Missing == false)
    {
-      FileFd CompFd;
       if (OpenOld(CompFd) == false)
       {
 	 _error->Discard();
-	 break;
+	 Missing = true;
+      }
+      else
+      {
+	 // if no thread can be started, the old file is hashed at the end
+	 try
+	 {
+	    OldHasher = std::thread([&]() { OldHash = OldFileHash(CompFd); });
+	 }
+	 catch (std::system_error const &)
+	 {
+	 }
       }
+   }
+
+   struct Ring
+   {
+      std::array<std::array<unsigned char, APT_BUFFER_SIZE>, 16> Buffers;
+      std::array<size_t, 16> Sizes{};
+      // number of outputs which still have to write a buffer
+      std::array<size_t, 16> Pending{};
+      unsigned long long Produced = 0;
+      bool Done = false;
+      std::mutex Lock;
+      std::condition_variable Changed;
+   };
+   auto R = std::make_unique<Ring>();
+   size_t const NumBuffers = R->Buffers.size();
 
-      // Compute the hash
-      Hashes OldMD5(Hashes::MD5SUM);
-      unsigned long long NewFileSize = 0;
-      while (1)
+   size_t NumOutputs = 0;
+   std::vector<std::thread> Writers;
+   std::vector<char> WriteFailed;
+   for (Files *I = Outputs; I != 0; I = I->Next)
+      ++NumOutputs;
+   WriteFailed.resize(NumOutputs, false);
+   auto const Writer = [&R, &WriteFailed, NumBuffers](Files *const I, size_t const Number) {
+      unsigned long long Consumed = 0;
+      std::unique_lock<std::mutex> Guard(R->Lock);
+      while (true)
       {
-	 unsigned long long Res = 0;
-	 if (CompFd.Read(Buffer.data(),Buffer.size(), &Res) == false)
-	    return _error->Errno("read",_("Failed to read while computing MD5"));
-	 if (Res == 0)
+	 R->Changed.wait(Guard, [&]() { return Consumed != R->Produced || R->Done; });
+	 if (Consumed == R->Produced)
 	    break;
-	 NewFileSize += Res;
-	 OldMD5.Add(Buffer.data(),Res);
+	 size_t const Slot = Consumed % NumBuffers;
+	 Guard.unlock();
+	 // keep on consuming after a failure so the reader isn't blocked
+	 if (WriteFailed[Number] == false && I->TmpFile.Write(R->Buffers[Slot].data(), R->Sizes[Slot]) == false)
+	    WriteFailed[Number] = true;
+	 Guard.lock();
+	 ++Consumed;
+	 if (--R->Pending[Slot] == 0)
+	    R->Changed.notify_all();
+      }
+      Guard.unlock();
+      // closing flushes the compressor, which is a lot of work for some
+      if (WriteFailed[Number] == false && I->TmpFile.Close() == false)
+	 WriteFailed[Number] = true;
+      // errors are local to this thread, so print them here
+      if (WriteFailed[Number])
+	 _error->DumpErrors(std::cerr);
+   };
+   // the outputs no thread could be started for are written by this thread
+   std::vector<std::pair<Files *, size_t>> Serial;
+   size_t Number = 0;
+   for (Files *I = Outputs; I != 0; I = I->Next, ++Number)
+   {
+      try
+      {
+	 if (Serial.empty())
+	    Writers.emplace_back(Writer, I, Number);
+	 else
+	    Serial.emplace_back(I, Number);
+      }
+      catch (std::system_error const &)
+      {
+	 Serial.emplace_back(I, Number);
       }
-      CompFd.Close();
+   }
+   size_t const NumThreaded = Writers.size();
 
-      // Check the hash
-      if (OldMD5.GetHashString(Hashes::MD5SUM) == MD5.GetHashString(Hashes::MD5SUM) &&
-	  FileSize == NewFileSize)
+   /* Okay, now we just feed data from FD to all the other FDs. Also
+      stash a hash of the data to use later. */
+   SetNonBlock(FD,false);
+   unsigned long long FileSize = 0;
+   Hashes MD5(Hashes::MD5SUM);
+   while (1)
+   {
+      size_t const Slot = R->Produced % NumBuffers;
       {
-	 for (Files *I = Outputs; I != 0; I = I->Next)
-	 {
-	    I->TmpFile.Close();
-	    RemoveFile("MultiCompress::Child", I->TmpFile.Name());
-	 }
-	 return !_error->PendingError();
-      }      
-      break;
+	 std::unique_lock<std::mutex> Guard(R->Lock);
+	 R->Changed.wait(Guard, [&]() { return R->Pending[Slot] == 0; });
+      }
+
+      WaitFd(FD,false);
+      int Res = read(FD,R->Buffers[Slot].data(),R->Buffers[Slot].size());
+      if (Res == 0)
+	 break;
+      if (Res < 0)
+	 continue;
+
+      MD5.Add(R->Buffers[Slot].data(),Res);
+      FileSize += Res;
+      for (auto const &S : Serial)
+	 if (WriteFailed[S.second] == false && S.first->TmpFile.Write(R->Buffers[Slot].data(), Res) == false)
+	    WriteFailed[S.second] = true;
+
+      std::lock_guard<std::mutex> Guard(R->Lock);
+      R->Sizes[Slot] = Res;
+      R->Pending[Slot] = NumThreaded;
+      ++R->Produced;
+      R->Changed.notify_all();
+   }
+   {
+      std::lock_guard<std::mutex> Guard(R->Lock);
+      R->Done = true;
+      R->Changed.notify_all();
+   }
+   for (auto const &S : Serial)
+      if (WriteFailed[S.second] == false && S.first->TmpFile.Close() == false)
+	 WriteFailed[S.second] = true;
+   for (auto &W : Writers)
+      W.join();
+   if (OldHasher.joinable())
+      OldHasher.join();
+   else if (Missing == false)
+      OldHash = OldFileHash(CompFd);
+
+   // the details of failed writes were reported already
+   if (std::find(WriteFailed.begin(), WriteFailed.end(), true) != WriteFailed.end())
+      _error->Error(_("IO to subprocess/file failed"));
+   if (_error->PendingError() == true)
+      return false;
+   
+   // Check the MD5 of the lowest cost entity.
+   if (OldHash.first.empty() == false &&
+       OldHash.first == MD5.GetHashString(Hashes::MD5SUM).HashValue() &&
+       OldHash.second == FileSize)
+   {
+      for (Files *I = Outputs; I != 0; I = I->Next)
+	 RemoveFile("MultiCompress::Child", I->TmpFile.Name());
+      return !_error->PendingError();
    }
 
    // Finalize
@@ -352,7 +466,6 @@ bool MultiCompress::Child(int const &FD)
       if (rename(I->TmpFile.Name().c_str(),I->Output.c_str()) != 0)
 	 _error->Errno("rename",_("Failed to rename %s to %s"),
 		       I->TmpFile.Name().c_str(),I->Output.c_str());
-      I->TmpFile.Close();
    }
    
    return !_error->PendingError();
@@ -12,6 +12,7 @@
 // Include Files							/*{{{*/
 #include <config.h>
 
+#include <apt-pkg/aptconfiguration.h>
 #include <apt-pkg/configuration.h>
 #include <apt-pkg/debfile.h>
 #include <apt-pkg/deblistparser.h>
@@ -27,13 +28,19 @@
 #include <algorithm>
 #include <cctype>
 #include <clocale>
+#include <condition_variable>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <system_error>
+#include <thread>
 #include <utility>
+#include <fcntl.h>
 #include <fnmatch.h>
 #include <ftw.h>
 #include <sys/stat.h>
@@ -137,23 +144,28 @@ int FTWScanner::ScannerFile(const char *const File, bool const ReadLink) /*{{{*/
    return 0;
 }
 									/*}}}*/
-int FTWScanner::ProcessFile(const char *const File, bool const ReadLink) /*{{{*/
+static std::string ResolveLink(const char *const File, bool const ReadLink) /*{{{*/
 {
-   /* Process it. If the file is a link then resolve it into an absolute
+   /* If the file is a link then resolve it into an absolute
       name.. This works best if the directory components the scanner are
       given are not links themselves. */
    char Jnk[2];
    char *RealPath = NULL;
-   Owner->OriginalPath = File;
    if (ReadLink &&
        readlink(File,Jnk,sizeof(Jnk)) != -1 &&
        (RealPath = realpath(File,NULL)) != 0)
    {
-      Owner->DoPackage(RealPath);
+      std::string const Resolved{RealPath};
       free(RealPath);
+      return Resolved;
    }
-   else
-      Owner->DoPackage(File);
+   return File;
+}
+									/*}}}*/
+int FTWScanner::ProcessFile(const char *const File, bool const ReadLink) /*{{{*/
+{
+   Owner->OriginalPath = File;
+   Owner->DoPackage(ResolveLink(File, ReadLink));
 
    if (_error->empty() == false)
    {
@@ -214,12 +226,18 @@ bool FTWScanner::RecursiveScan(string const &Dir)
    std::sort(FilesToProcess.begin(), FilesToProcess.end(), [](PairType a, PairType b) {
       return a.first < b.first;
    });
-   if (not std::all_of(FilesToProcess.cbegin(), FilesToProcess.cend(), [](auto &&it) { return ProcessFile(it.first.c_str(), it.second) == 0; }))
+   if (ProcessFiles() == false)
       return false;
    FilesToProcess.clear();
    return true;
 }
 									/*}}}*/
+// FTWScanner::ProcessFiles - Process the files found by the scan	/*{{{*/
+bool FTWScanner::ProcessFiles()
+{
+   return std::all_of(FilesToProcess.cbegin(), FilesToProcess.cend(), [](auto &&it) { return ProcessFile(it.first.c_str(), it.second) == 0; });
+}
+									/*}}}*/
 // FTWScanner::LoadFileList - Load the file list from a file		/*{{{*/
 // ---------------------------------------------------------------------
 /* This is an alternative to using FTW to locate files, it reads the list
@@ -521,6 +539,107 @@ bool PackagesWriter::DoPackage(string FileName)
    return Db.Finish();
 }
 									/*}}}*/
+// PackagesWriter::ProcessFiles - Process files with prefetching	/*{{{*/
+// ---------------------------------------------------------------------
+/* Opening, extracting and hashing new debs is done by a pool of threads
+   working ahead of the files currently written out. The database and
+   the output are only ever touched from this thread, in sorted order. */
+bool PackagesWriter::ProcessFiles()
+{
+   int NumJobs = _config->FindI("APT::FTPArchive::Packages::Jobs", 1);
+   if (NumJobs == 0)
+      NumJobs = std::max(1u, std::thread::hardware_concurrency());
+   if (NumJobs <= 1 || FilesToProcess.size() < 2)
+      return FTWScanner::ProcessFiles();
+
+   // fill static caches before they are used by multiple threads
+   APT::Configuration::getCompressors();
+
+   struct Job
+   {
+      std::unique_ptr<CacheDB::Prefetch> Work;
+      bool Done = false;
+   };
+   std::vector<Job> Jobs(FilesToProcess.size());
+   std::deque<Job *> Queue;
+   std::mutex Lock;
+   std::condition_variable Wakeup, Finished;
+   bool Stop = false;
+
+   auto const Worker = [&]() {
+      std::unique_lock<std::mutex> Guard(Lock);
+      while (true)
+      {
+	 Wakeup.wait(Guard, [&]() { return Stop || Queue.empty() == false; });
+	 if (Queue.empty())
+	    return;
+	 Job * const J = Queue.front();
+	 Queue.pop_front();
+	 Guard.unlock();
+	 J->Work->Failed = J->Work->Run() == false;
+	 // the main thread redoes failed work and reports errors then
+	 _error->Discard();
+	 Guard.lock();
+	 J->Done = true;
+	 Finished.notify_all();
+      }
+   };
+   std::vector<std::thread> Workers;
+   for (int I = 0; I < NumJobs; ++I)
+   {
+      try
+      {
+	 Workers.emplace_back(Worker);
+      }
+      catch (std::system_error const &)
+      {
+	 break;
+      }
+   }
+   if (Workers.empty())
+      return FTWScanner::ProcessFiles();
+
+   // keep the memory used for prefetched control and contents data bounded
+   size_t const Window = Workers.size() * 4;
+   size_t Planned = 0;
+   for (size_t I = 0; I < FilesToProcess.size(); ++I)
+   {
+      for (; Planned < FilesToProcess.size() && Planned < I + Window; ++Planned)
+      {
+	 auto const &File = FilesToProcess[Planned];
+	 auto Work = Db.PlanPrefetch(ResolveLink(File.first.c_str(), File.second),
+	       true, DoContents, DoHashes, DoAlwaysStat);
+	 std::lock_guard<std::mutex> Guard(Lock);
+	 if (Work == nullptr)
+	    Jobs[Planned].Done = true;
+	 else
+	 {
+	    Jobs[Planned].Work = std::move(Work);
+	    Queue.push_back(&Jobs[Planned]);
+	    Wakeup.notify_one();
+	 }
+      }
+
+      {
+	 std::unique_lock<std::mutex> Guard(Lock);
+	 Finished.wait(Guard, [&]() { return Jobs[I].Done; });
+      }
+      Db.SetPrefetch(Jobs[I].Work.get());
+      ProcessFile(FilesToProcess[I].first.c_str(), FilesToProcess[I].second);
+      Db.SetPrefetch(nullptr);
+      Jobs[I].Work.reset();
+   }
+
+   {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Stop = true;
+      Wakeup.notify_all();
+   }
+   for (auto &W : Workers)
+      W.join();
+   return true;
+}
+									/*}}}*/
 PackagesWriter::~PackagesWriter()					/*{{{*/
 {
 }
@@ -1038,10 +1157,95 @@ ReleaseWriter::ReleaseWriter(FileFd * const GivenOutput, string const &/*DB*/) :
    }
 
    ConfigToDoHashes(DoHashes, "APT::FTPArchive::Release");
+
+   HashCacheFile = _config->Find("APT::FTPArchive::Release::HashCache");
+   if (HashCacheFile.empty() == false && FileExists(HashCacheFile) == true &&
+       ReadHashCache() == false)
+   {
+      _error->Warning(_("Ignoring the hash cache %s"), HashCacheFile.c_str());
+      OldHashCache.clear();
+   }
+}
+									/*}}}*/
+// ReleaseWriter::ReadHashCache - Load the hashes of the last run	/*{{{*/
+// ---------------------------------------------------------------------
+/* The cache has a stanza for each file with the state of the file as
+   returned by stat and its hashes at the time of the last run. */
+bool ReleaseWriter::ReadHashCache()
+{
+   FileFd Fd(HashCacheFile, FileFd::ReadOnly);
+   if (Fd.IsOpen() == false)
+      return false;
+   pkgTagFile Tags(&Fd);
+   pkgTagSection Section;
+   while (Tags.Step(Section) == true)
+   {
+      CachedHashes Cached;
+      Cached.Stat = Section.FindS("Stat");
+      for (char const * const * Type = HashString::SupportedHashes(); *Type != nullptr; ++Type)
+      {
+	 std::string const Value = Section.FindS(*Type);
+	 if (Value.empty() == false)
+	    Cached.Hashes.push_back(HashString(*Type, Value));
+      }
+      OldHashCache[Section.FindS("Filename")] = std::move(Cached);
+   }
+   return _error->PendingError() == false;
+}
+									/*}}}*/
+// ReleaseWriter::WriteHashCache - Store the hashes of this run	/*{{{*/
+bool ReleaseWriter::WriteHashCache()
+{
+   FileFd Fd(HashCacheFile, FileFd::WriteAtomic, 0644);
+   if (Fd.IsOpen() == false)
+      return false;
+   for (auto const &F : NewHashCache)
+   {
+      std::string out;
+      strprintf(out, "Filename: %s\nStat: %s\n", F.first.c_str(), F.second.Stat.c_str());
+      for (auto const &H : F.second.Hashes)
+	 out.append(H.HashType()).append(": ").append(H.HashValue()).append("\n");
+      out.append("\n");
+      if (Fd.Write(out.c_str(), out.length()) == false)
+	 return false;
+   }
+   return Fd.Close();
 }
 									/*}}}*/
 // ReleaseWriter::DoPackage - Process a single package			/*{{{*/
 // ---------------------------------------------------------------------
+/* A file is assumed to be unchanged if inode, size, mtime and ctime are
+   still the same as recorded in the hash cache */
+static std::string StatSignature(struct stat const &St)
+{
+   std::string Signature;
+   strprintf(Signature, "%llu %llu %llu %lld.%09ld %lld.%09ld",
+	 static_cast<unsigned long long>(St.st_dev),
+	 static_cast<unsigned long long>(St.st_ino),
+	 static_cast<unsigned long long>(St.st_size),
+	 static_cast<long long>(St.st_mtim.tv_sec), St.st_mtim.tv_nsec,
+	 static_cast<long long>(St.st_ctim.tv_sec), St.st_ctim.tv_nsec);
+   return Signature;
+}
+static bool CachedHashesUsable(HashStringList const &Cached, unsigned int const DoHashes, HashStringList &Hashes)
+{
+   std::pair<unsigned int, char const *> const Types[] = {
+      {Hashes::MD5SUM, "MD5Sum"},
+      {Hashes::SHA1SUM, "SHA1"},
+      {Hashes::SHA256SUM, "SHA256"},
+      {Hashes::SHA512SUM, "SHA512"},
+   };
+   for (auto const &T : Types)
+   {
+      if ((DoHashes & T.first) != T.first)
+	 continue;
+      HashString const * const hs = Cached.find(T.second);
+      if (hs == nullptr)
+	 return false;
+      Hashes.push_back(*hs);
+   }
+   return true;
+}
 bool ReleaseWriter::DoPackage(string FileName)
 {
    // Strip the DirStrip prefix from the FileName and add the PathPrefix
@@ -1061,26 +1265,46 @@ bool ReleaseWriter::DoPackage(string FileName)
    if (PathPrefix.empty() == false)
       NewFileName = flCombine(PathPrefix,NewFileName);
 
-   FileFd fd(FileName, FileFd::ReadOnly);
-
-   if (!fd.IsOpen())
+   struct stat St;
+   std::string Signature;
+   if (HashCacheFile.empty() == false && stat(FileName.c_str(), &St) == 0)
+      Signature = StatSignature(St);
+
+   HashStringList hsl;
+   bool Reused = false;
+   auto const Cached = OldHashCache.find(FileName);
+   if (Signature.empty() == false && Cached != OldHashCache.end() &&
+       Cached->second.Stat == Signature &&
+       CachedHashesUsable(Cached->second.Hashes, DoHashes, hsl) == true)
    {
-      return false;
+      CheckSums[NewFileName].size = St.st_size;
+      Reused = true;
    }
+   else
+   {
+      FileFd fd(FileName, FileFd::ReadOnly);
 
-   CheckSums[NewFileName].size = fd.Size();
+      if (!fd.IsOpen())
+      {
+	 return false;
+      }
 
-   Hashes hs(DoHashes);
-   hs.AddFD(fd);
-   CheckSums[NewFileName].Hashes = hs.GetHashStringList();
-   fd.Close();
+      CheckSums[NewFileName].size = fd.Size();
+
+      Hashes hs(DoHashes);
+      hs.AddFD(fd);
+      hsl = hs.GetHashStringList();
+      fd.Close();
+   }
+   CheckSums[NewFileName].Hashes = hsl;
+   if (Signature.empty() == false)
+      NewHashCache[FileName] = {Signature, hsl};
 
    // FIXME: wrong layer in the code(?)
    // FIXME2: symlink instead of create a copy
    if (_config->FindB("APT::FTPArchive::DoByHash", false) == true)
    {
       std::string Input = FileName;
-      HashStringList hsl = hs.GetHashStringList();
       for(HashStringList::const_iterator h = hsl.begin();
           h != hsl.end(); ++h)
       {
@@ -1090,6 +1314,12 @@ bool ReleaseWriter::DoPackage(string FileName)
             continue;
 
          std::string ByHashOutputFile = GenByHashFilename(Input, *h);
+         // an unchanged file is already available by-hash, it just has to
+         // stay one of the most recent ones for the cleanup in Finish
+         if (Reused == true && utimensat(AT_FDCWD, ByHashOutputFile.c_str(), nullptr, 0) == 0)
+            continue;
+         ChangedDirs.insert(flNotFile(NewFileName));
+
          std::string ByHashOutputDir = flNotFile(ByHashOutputFile);
          if(!CreateDirectory(flNotFile(Input), ByHashOutputDir))
             return _error->Warning("can not create dir %s", flNotFile(ByHashOutputFile).c_str());
@@ -1161,6 +1391,10 @@ void ReleaseWriter::Finish()
          keepFiles *= std::distance(prev, I);
          prev = I;
 
+         // nothing was added to this by-hash directory in this run
+         if (ChangedDirs.find(flNotFile(prev->first)) == ChangedDirs.end())
+            continue;
+
          HashStringList hsl = prev->second.Hashes;
          for(HashStringList::const_iterator h = hsl.begin();
              h != hsl.end(); ++h)
@@ -1175,4 +1409,7 @@ void ReleaseWriter::Finish()
          }
       }
    }
+
+   if (HashCacheFile.empty() == false && WriteHashCache() == false)
+      _error->Warning(_("Failed to write the hash cache %s"), HashCacheFile.c_str());
 }
@@ -52,6 +52,7 @@ class FTWScanner
    static int ScannerFTW(const char *File,const struct stat *sb,int Flag);
    static int ScannerFile(const char *const File, bool const ReadLink);
    static int ProcessFile(const char *const File, bool const ReadLink);
+   virtual bool ProcessFiles();
 
    bool Delink(string &FileName,const char *OriginalPath,
 	       unsigned long long &Bytes,unsigned long long const &FileSize);
@@ -106,6 +107,9 @@ class PackagesWriter : public FTWScanner
    Override Over;
    CacheDB Db;
 
+   protected:
+   bool ProcessFiles() override;
+
    public:
 
    // Some flags
@@ -203,6 +207,21 @@ public:
    };
 protected:
    map<string,struct CheckSum> CheckSums;
+
+   // Hashes of unchanged files are reused from the previous run
+   struct CachedHashes
+   {
+      string Stat;
+      HashStringList Hashes;
+   };
+   string HashCacheFile;
+   map<string,CachedHashes> OldHashCache;
+   map<string,CachedHashes> NewHashCache;
+   // directories in which new by-hash files were created
+   std::set<string> ChangedDirs;
+
+   bool ReadHashCache();
+   bool WriteHashCache();
 };
 
 #endif
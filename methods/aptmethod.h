@@ -387,6 +387,9 @@ protected:
 
 #undef ALLOW
 
+      // hashing in parallel needs threads, but clone is not allowed
+      _config->Set("APT::Hashes::Parallel", false);
+
       rc = seccomp_load(ctx);
       if (rc == -EINVAL)
       {
@@ -3,6 +3,7 @@
 #include <apt-pkg/configuration.h>
 #include <apt-pkg/fileutl.h>
 
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -230,6 +231,35 @@ List::Option2 { "Multi";
    EXPECT_TRUE(Cnf.FindB("Trailing"));
    EXPECT_FALSE(Cnf.Exists("Commented::Out"));
 }
+TEST(ConfigurationTest, Snapshot)
+{
+   Configuration Cnf;
+   Cnf.Set("APT::Keep-Fds::", 28);
+   Cnf.Set("APT::Keep-Fds::", 17);
+   Cnf.Set("Dir::Cache", "var/cache/apt");
+   Cnf.Set("Empty::Value", "");
+   Cnf.Set("Dir", "/");
+   std::ostringstream expected;
+   Cnf.Dump(expected);
+
+   FileFd fd;
+   openTemporaryFile("configsnapshot", fd, nullptr, false);
+   ScopedFileDeleter const deleter(fd.Name());
+   fd.Close();
+   EXPECT_TRUE(Cnf.WriteSnapshot(deleter.Name(), 42));
+
+   Configuration Loaded;
+   Loaded.Set("Not::In::Snapshot", "true");
+   EXPECT_FALSE(Loaded.Exists("Dir::Cache"));
+   EXPECT_FALSE(Loaded.ReadSnapshot(deleter.Name(), 23));
+   EXPECT_TRUE(Loaded.ReadSnapshot(deleter.Name(), 42));
+   std::ostringstream loaded;
+   Loaded.Dump(loaded);
+   EXPECT_EQ(expected.str(), loaded.str());
+   EXPECT_FALSE(Loaded.Exists("Not::In::Snapshot"));
+   EXPECT_EQ("var/cache/apt", Loaded.Find("Dir::Cache"));
+   EXPECT_EQ(2u, Loaded.FindVector("APT::Keep-Fds").size());
+}
 
 TEST(ConfigurationTest, Color)
 {